@@ -0,0 +1,81 @@
+/* Compares memory and time of list-based and streaming evaluation on one huge expression.
+   Parser is started as child process, so its peak memory can be taken from wait4().
+   Usage: stream_bench <path to parser> [number of tokens]
+ */
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+const std::string unit = "1+2*3-4/2+"; // 10 tokens, adds 5 to the result
+
+bool run(const char* parser, const char* mode, long units){
+	int to_child[2], from_child[2];
+	if(pipe(to_child) || pipe(from_child))
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if(pid == 0){
+		dup2(to_child[0], STDIN_FILENO);
+		dup2(from_child[1], STDOUT_FILENO);
+		close(to_child[1]);
+		close(from_child[0]);
+		execl(parser, parser, mode, (char*)nullptr);
+		_exit(127);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+
+	if(fork() == 0){ // expression is written by separate process, so reading of the output never blocks it
+		close(from_child[0]);
+		FILE* input = fdopen(to_child[1], "w");
+		fputs("\n", input); // no libraries
+		for(long i = 0; i < units; i++)
+			fputs(unit.c_str(), input);
+		fputs("0\n", input);
+		fclose(input);
+		_exit(0);
+	}
+	close(to_child[1]);
+
+	std::string last_line, line;
+	char buf[1 << 16];
+	ssize_t len;
+	while((len = read(from_child[0], buf, sizeof(buf))) > 0) // only the last line is interesting, it contains the result
+		for(ssize_t i = 0; i < len; i++){
+			if(buf[i] == '\n')
+				last_line.swap(line), line.clear();
+			else if(line.size() < 256)
+				line += buf[i];
+		}
+	close(from_child[0]);
+
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	wait(nullptr);
+
+	std::cout << (mode[0] ? mode : "(lists)") << "\t" << units * unit.size() << " tokens\t"
+		  << seconds << " s\t" << usage.ru_maxrss / 1024 << " MB peak\t"
+		  << "result " << last_line.substr(last_line.find_last_of(' ') + 1)
+		  << " (expected " << units * 5 << ")" << std::endl;
+	return true;
+}
+
+int main(int argc, char* argv[]){
+	if(argc < 2){
+		std::cout << "Usage: " << argv[0] << " <path to parser> [number of tokens]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	long tokens = argc > 2 ? atol(argv[2]) : 10000000;
+	long units = tokens / unit.size();
+
+	run(argv[1], "--stream", units);
+	run(argv[1], "", units);
+}
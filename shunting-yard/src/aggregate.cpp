@@ -0,0 +1,320 @@
+#include "aggregate.hpp"
+#include "program.hpp"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+inline void addCompensated(double& sum, double& compensation, double value){ // Kahan summation
+	double y = value - compensation;
+	double t = sum + y;
+	compensation = std::isfinite(t) ? (t - sum) - y : 0; // inf - inf would turn infinite sum into NaN
+	sum = t;
+}
+
+Accumulator::Accumulator() : errors(0){
+	for(int lane = 0; lane < AGGREGATE_LANES; lane++){
+		sum[lane] = 0;
+		compensation[lane] = 0;
+		min[lane] = std::numeric_limits<double>::infinity();
+		max[lane] = -std::numeric_limits<double>::infinity();
+		count[lane] = 0;
+	}
+}
+
+/* Lanes are kept in vectors of two doubles(one SSE register), every operation on them is one SIMD instruction.
+   Written by hand: compensation of a lane depends on the sum from previous row, which is neither reduction nor
+   induction, so the auto-vectorizer of GCC leaves such loop scalar. Selects use masks made by comparisons,
+   so they compile to and/andn/or instead of branches.
+ */
+#define LANE_WIDTH 2
+typedef double lanes_t __attribute__((vector_size(LANE_WIDTH * sizeof(double))));
+typedef int64_t lane_mask_t __attribute__((vector_size(LANE_WIDTH * sizeof(int64_t))));
+const int lane_vectors = AGGREGATE_LANES / LANE_WIDTH;
+static_assert(AGGREGATE_LANES % LANE_WIDTH == 0 && AGGREGATE_LANES > 0, "AGGREGATE_LANES must be a positive multiple of LANE_WIDTH");
+
+void Accumulator::add(const double* __restrict values, const unsigned char* __restrict valid, size_t rows){
+	const lanes_t zero = {}, inf = zero + std::numeric_limits<double>::infinity();
+	lanes_t lane_sum[lane_vectors], lane_compensation[lane_vectors], lane_min[lane_vectors], lane_max[lane_vectors];
+	lane_mask_t lane_count[lane_vectors];
+	memcpy(lane_sum, sum, sizeof(lane_sum)); // state is kept in registers and written back once per block
+	memcpy(lane_compensation, compensation, sizeof(lane_compensation));
+	memcpy(lane_min, min, sizeof(lane_min));
+	memcpy(lane_max, max, sizeof(lane_max));
+	memcpy(lane_count, count, sizeof(lane_count));
+
+	size_t r = 0;
+	for(; r + AGGREGATE_LANES <= rows; r += AGGREGATE_LANES) // invalid rows add nothing instead of branching
+#pragma GCC unroll 8
+		for(int v = 0; v < lane_vectors; v++){ // unrolled, so lanes stay in registers
+			lanes_t value, flags;
+			memcpy(&value, values + r + v * LANE_WIDTH, sizeof(value));
+			for(int i = 0; i < LANE_WIDTH; i++)
+				flags[i] = valid[r + v * LANE_WIDTH + i];
+			lane_mask_t is_valid = flags != zero; // all bits set for valid row
+
+			lanes_t y = (is_valid ? value : zero) - lane_compensation[v];
+			lanes_t t = lane_sum[v] + y;
+			lane_compensation[v] = t - t == zero ? (t - lane_sum[v]) - y : zero; // t - t isn't zero only for infinite sum, see addCompensated()
+			lane_sum[v] = t;
+			lanes_t low = is_valid ? value : inf, high = is_valid ? value : -inf;
+			lane_min[v] = low < lane_min[v] ? low : lane_min[v]; // NaN rows are ignored, as by fmin()
+			lane_max[v] = high > lane_max[v] ? high : lane_max[v];
+			lane_count[v] -= is_valid;
+		}
+
+	memcpy(sum, lane_sum, sizeof(lane_sum));
+	memcpy(compensation, lane_compensation, sizeof(lane_compensation));
+	memcpy(min, lane_min, sizeof(lane_min));
+	memcpy(max, lane_max, sizeof(lane_max));
+	memcpy(count, lane_count, sizeof(lane_count));
+
+	for(int lane = 0; r < rows; r++, lane++){ // less than AGGREGATE_LANES rows left
+		if(!valid[r])
+			continue;
+		addCompensated(sum[lane], compensation[lane], values[r]);
+		min[lane] = std::fmin(min[lane], values[r]);
+		max[lane] = std::fmax(max[lane], values[r]);
+		count[lane]++;
+	}
+}
+
+void Accumulator::merge(const Accumulator& acc){
+	for(int lane = 0; lane < AGGREGATE_LANES; lane++){
+		addCompensated(sum[lane], compensation[lane], acc.sum[lane] - acc.compensation[lane]);
+		min[lane] = std::fmin(min[lane], acc.min[lane]);
+		max[lane] = std::fmax(max[lane], acc.max[lane]);
+		count[lane] += acc.count[lane];
+	}
+	errors += acc.errors;
+}
+
+uint64_t Accumulator::getCount() const{
+	uint64_t total = 0;
+	for(int lane = 0; lane < AGGREGATE_LANES; lane++)
+		total += count[lane];
+	return total;
+}
+
+double Accumulator::getResult(AGGREGATE aggregate) const{
+	double total = 0, total_compensation = 0, low = min[0], high = max[0];
+	for(int lane = 0; lane < AGGREGATE_LANES; lane++){
+		addCompensated(total, total_compensation, sum[lane] - compensation[lane]);
+		low = std::fmin(low, min[lane]);
+		high = std::fmax(high, max[lane]);
+	}
+
+	uint64_t rows = getCount();
+	switch(aggregate){
+	case AGGREGATE::SUM:
+		return total;
+	case AGGREGATE::MIN:
+		return rows ? low : NAN;
+	case AGGREGATE::MAX:
+		return rows ? high : NAN;
+	case AGGREGATE::MEAN:
+		return rows ? total / rows : NAN;
+	}
+	return NAN;
+}
+
+struct RowBlock{
+	std::vector<double> values; // column after column, AGGREGATE_BLOCK values each
+	size_t rows;
+};
+
+class BlockQueue{ // blocks go from reader to workers and back, so memory is allocated only at start
+	std::deque<RowBlock*> blocks;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool closed = false;
+public:
+	void push(RowBlock* block){
+		std::lock_guard<std::mutex> lock(mutex);
+		blocks.push_back(block);
+		changed.notify_one();
+	}
+	RowBlock* pop(){ // returns nullptr when queue is closed and empty
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this](){ return !blocks.empty() || closed; });
+		if(blocks.empty())
+			return nullptr;
+		RowBlock* block = blocks.front();
+		blocks.pop_front();
+		return block;
+	}
+	void close(){
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		changed.notify_all();
+	}
+};
+
+STATUS parseQuery(const std::string& query, AGGREGATE& aggregate, std::string& expression, size_t& position){
+	size_t open = query.find('(');
+	size_t close = query.find_last_of(')');
+	position = 1;
+	if(open == std::string::npos || close == std::string::npos || close < open ||
+	   query.find_first_not_of(" \t\r", close + 1) != std::string::npos)
+		return STATUS::MALFORMED_EXPRESSION;
+
+	std::string name = query.substr(0, open);
+	name.erase(0, name.find_first_not_of(" \t"));
+	name.erase(name.find_last_not_of(" \t") + 1);
+	if(name == "sum")
+		aggregate = AGGREGATE::SUM;
+	else if(name == "min")
+		aggregate = AGGREGATE::MIN;
+	else if(name == "max")
+		aggregate = AGGREGATE::MAX;
+	else if(name == "mean")
+		aggregate = AGGREGATE::MEAN;
+	else
+		return STATUS::UNKNOWN_AGGREGATE;
+
+	if(query.find_first_not_of(" \t", open + 1) == close){
+		position = close + 1;
+		return STATUS::EMPTY_EXPRESSION;
+	}
+	expression = query.substr(open, close - open + 1); // parentheses are kept, so leading unary minus is recognized
+	return STATUS::OK;
+}
+
+std::vector<std::string> splitFields(const std::string& line){
+	std::vector<std::string> fields;
+	size_t start = line.find_first_not_of(" \t,\r");
+	while(start != std::string::npos){
+		size_t end = line.find_first_of(" \t,\r", start);
+		fields.push_back(line.substr(start, end - start));
+		start = end == std::string::npos ? end : line.find_first_not_of(" \t,\r", end);
+	}
+	return fields;
+}
+
+bool readRow(std::streambuf* buf, double* values, size_t columns, bool& valid){ // returns false at the end of input
+	int c;
+	while((c = buf->sgetc()) == '\n' || c == '\r') // empty lines are not rows
+		buf->sbumpc();
+	if(c == EOF)
+		return false;
+
+	char field[64];
+	size_t column = 0;
+	valid = true;
+	while((c = buf->sbumpc()) != EOF && c != '\n'){
+		if(c == ' ' || c == '\t' || c == ',' || c == '\r')
+			continue;
+
+		size_t length = 0;
+		bool truncated = false; // longer field isn't a number we can read, cut one would be parsed as another number
+		do{
+			if(length < sizeof(field) - 1)
+				field[length++] = c;
+			else
+				truncated = true;
+			c = buf->sgetc();
+			if(c == EOF || c == '\n' || c == ' ' || c == '\t' || c == ',' || c == '\r')
+				break;
+			buf->sbumpc();
+		} while(true);
+		field[length] = '\0';
+
+		char* end;
+		double value = strtod(field, &end);
+		if(column < columns && *end == '\0' && !truncated)
+			values[column * AGGREGATE_BLOCK] = value;
+		else
+			valid = false;
+		column++;
+	}
+	if(column != columns)
+		valid = false;
+	return true;
+}
+
+STATUS aggregateQuery(std::istream& in, double& result, uint64_t& rows, uint64_t& errors, size_t& position){
+	std::string query, header;
+	if(!std::getline(in, query) || !std::getline(in, header))
+		return STATUS::EMPTY_EXPRESSION;
+
+	AGGREGATE aggregate;
+	std::string expression;
+	STATUS status = parseQuery(query, aggregate, expression, position);
+	if(status != STATUS::OK)
+		return status;
+
+	std::vector<std::string> variables = splitFields(header);
+	Program program;
+	status = compileProgram(expression, variables, program, position);
+	position += query.find('('); // position in the query, not in expression
+	if(status != STATUS::OK)
+		return status;
+
+	ProgramView program_view = program.view();
+	unsigned thread_count = AGGREGATE_THREADS ? AGGREGATE_THREADS : std::thread::hardware_concurrency();
+	if(thread_count == 0)
+		thread_count = 1;
+
+	BlockQueue full_blocks, free_blocks;
+	std::vector<RowBlock> block_memory(2 * thread_count);
+	for(auto& block : block_memory){
+		block.values.resize(variables.size() * AGGREGATE_BLOCK);
+		free_blocks.push(&block);
+	}
+
+	std::vector<Accumulator> accumulators(thread_count);
+	std::vector<std::thread> workers;
+	for(unsigned i = 0; i < thread_count; i++)
+		workers.emplace_back([&, i](){
+			std::vector<const double*> columns(variables.size());
+			std::vector<double> results(AGGREGATE_BLOCK);
+			std::vector<unsigned char> valid(AGGREGATE_BLOCK);
+
+			while(RowBlock* block = full_blocks.pop()){
+				for(size_t col = 0; col < columns.size(); col++)
+					columns[col] = block->values.data() + col * AGGREGATE_BLOCK;
+				evaluateBlock(program_view, columns.data(), block->rows, results.data(), valid.data());
+				accumulators[i].add(results.data(), valid.data(), block->rows);
+				for(size_t r = 0; r < block->rows; r++)
+					accumulators[i].errors += !valid[r];
+				free_blocks.push(block);
+			}
+		});
+
+	std::streambuf* buf = in.rdbuf();
+	uint64_t malformed_rows = 0;
+	RowBlock* block = free_blocks.pop();
+	block->rows = 0;
+	bool valid;
+	while(readRow(buf, block->values.data() + block->rows, variables.size(), valid)){
+		if(!valid){
+			malformed_rows++;
+			continue;
+		}
+		if(++block->rows == AGGREGATE_BLOCK){
+			full_blocks.push(block);
+			block = free_blocks.pop();
+			block->rows = 0;
+		}
+	}
+	if(block->rows)
+		full_blocks.push(block);
+	full_blocks.close();
+	for(auto& worker : workers)
+		worker.join();
+
+	Accumulator total;
+	for(auto& acc : accumulators)
+		total.merge(acc);
+
+	result = total.getResult(aggregate);
+	rows = total.getCount();
+	errors = total.errors + malformed_rows;
+	return STATUS::OK;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "meta.hpp"
+#include "token.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+enum class AGGREGATE{
+	SUM,
+	MIN,
+	MAX,
+	MEAN
+};
+
+/* AGGREGATE_LANES independent accumulators, row r goes to lane r % AGGREGATE_LANES. Lanes don't depend on each other,
+   so add() keeps them in SIMD vectors. Sums are compensated(Kahan), lanes are merged compensated too.
+   Every thread has its own accumulator, alignment keeps neighbouring ones off the same cache line.
+ */
+class alignas(64) Accumulator{
+	double sum[AGGREGATE_LANES];
+	double compensation[AGGREGATE_LANES];
+	double min[AGGREGATE_LANES];
+	double max[AGGREGATE_LANES];
+	uint64_t count[AGGREGATE_LANES];
+public:
+	uint64_t errors; // rows skipped because of evaluation errors
+	Accumulator();
+	void add(const double* __restrict values, const unsigned char* __restrict valid, size_t rows);
+	void merge(const Accumulator& acc);
+	uint64_t getCount() const;
+	double getResult(AGGREGATE aggregate) const;
+};
+
+/* Reads query like "sum(x * 2 + y)", then line with names of columns, then rows of values separated by spaces or commas
+   until the end of input. Rows are evaluated by AGGREGATE_THREADS threads in blocks, per-row results are never stored.
+   Malformed rows and rows with evaluation errors are counted in errors and skipped.
+ */
+STATUS aggregateQuery(std::istream& in, double& result, uint64_t& rows, uint64_t& errors, size_t& position);
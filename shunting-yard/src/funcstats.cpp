@@ -0,0 +1,71 @@
+#include "funcstats.hpp"
+#include "importlib.hpp"
+#include <algorithm>
+#include <iomanip>
+
+#ifdef FUNC_STATS_SUPPORT
+FunctionStats::FunctionStats() : calls(0), total_ns(0){
+	for(auto& bucket : buckets)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+void FunctionStats::record(uint64_t ns){
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if(bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	calls.fetch_add(1, std::memory_order_relaxed);
+	total_ns.fetch_add(ns, std::memory_order_relaxed);
+	buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+FunctionStatsSnapshot::FunctionStatsSnapshot(const std::string& name, const FunctionStats& stats) : name(name){
+	calls = stats.calls.load(std::memory_order_relaxed);
+	total_ns = stats.total_ns.load(std::memory_order_relaxed);
+	for(int i = 0; i < STATS_BUCKETS; i++)
+		buckets[i] = stats.buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t FunctionStatsSnapshot::percentile(double p) const{
+	uint64_t counted = 0;
+	for(int i = 0; i < STATS_BUCKETS; i++){
+		counted += buckets[i];
+		if(counted && counted >= p * calls)
+			return i ? (i == STATS_BUCKETS - 1 ? UINT64_MAX : (uint64_t(1) << i) - 1) : 0;
+	}
+	return 0;
+}
+
+std::vector<FunctionStatsSnapshot> getFunctionStats(){
+	std::vector<FunctionStatsSnapshot> result;
+	const FunctionTable* table = readLockFunctionTable();
+	if(table)
+		for(auto& entry : table->stats_map)
+			result.emplace_back(entry.first, *entry.second);
+	readUnlockFunctionTable();
+
+	std::sort(result.begin(), result.end(), [](const FunctionStatsSnapshot& a, const FunctionStatsSnapshot& b){
+			return a.total_ns > b.total_ns;
+		});
+	return result;
+}
+
+void printFunctionStats(std::ostream& ost){
+	auto stats = getFunctionStats();
+	if(stats.empty())
+		return;
+
+	ost << "Top functions by total time:" << std::endl
+	    << std::left << std::setw(20) << "function" << std::right
+	    << std::setw(12) << "calls" << std::setw(14) << "total, us"
+	    << std::setw(12) << "mean, ns" << std::setw(12) << "p50, ns" << std::setw(12) << "p99, ns" << std::endl;
+
+	for(auto& func : stats)
+		ost << std::left << std::setw(20) << func.name << std::right
+		    << std::setw(12) << func.calls
+		    << std::setw(14) << func.total_ns / 1000
+		    << std::setw(12) << (func.calls ? func.total_ns / func.calls : 0)
+		    << std::setw(12) << func.percentile(0.5)
+		    << std::setw(12) << func.percentile(0.99) << std::endl;
+}
+#endif
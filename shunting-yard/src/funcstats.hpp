@@ -0,0 +1,33 @@
+#pragma once
+#include "meta.hpp"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#ifdef FUNC_STATS_SUPPORT
+#define STATS_BUCKETS 64 // bucket i counts calls that took [2^(i-1), 2^i) nanoseconds
+
+class FunctionStats{ // updated with relaxed atomics only, so calls never wait for each other
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> total_ns;
+	std::atomic<uint64_t> buckets[STATS_BUCKETS];
+public:
+	FunctionStats();
+	void record(uint64_t ns);
+	friend struct FunctionStatsSnapshot;
+};
+
+struct FunctionStatsSnapshot{
+	std::string name;
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t buckets[STATS_BUCKETS];
+	FunctionStatsSnapshot(const std::string& name, const FunctionStats& stats);
+	uint64_t percentile(double p) const; // upper bound of the bucket containing p-th percentile, in nanoseconds
+};
+
+std::vector<FunctionStatsSnapshot> getFunctionStats(); // sorted by total time, slowest first
+void printFunctionStats(std::ostream& ost);
+#endif
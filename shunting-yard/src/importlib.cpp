@@ -1,64 +1,108 @@
 #include "meta.hpp"
+#include "importlib.hpp"
+#include "shmcache.hpp"
 #include <iostream>
 #include <string>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <boost/filesystem.hpp>
 #include <dlfcn.h>
 #include <unistd.h>
 #include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cassert>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#ifdef HOT_RELOAD_SUPPORT
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 
 using namespace boost::filesystem;
 
-std::vector<std::string> lib_list; // contains full paths to libraries
-std::unordered_map<std::string, void*> func_map; // hash table of "function name - function pointer"
-std::vector<void*> lib_handle_list;
+#ifdef LIB_SUPPORT
+std::string lib_path; // folder with libraries
+std::atomic<const FunctionTable*> func_table(nullptr); // currently published table
+
+/* Lock-free readers in RCU fashion: reader marks itself in the counter of current epoch, writer flips epoch
+   and waits for readers of previous epoch to leave. Doing it twice guarantees that nobody can still hold old table.
+ */
+std::atomic<unsigned> reader_epoch(0);
+std::atomic<unsigned> active_readers[2] = {{0}, {0}};
+thread_local const FunctionTable* locked_table = nullptr;
+thread_local unsigned locked_epoch;
+thread_local unsigned lock_depth = 0; // nested locks keep the outermost table and epoch
 
 bool noLibrariesNeeded = false;
+std::ostream* lib_messages = &std::cout;
+thread_local std::ostringstream* thread_messages = nullptr; // watcher thread mustn't write to stream used by main thread
 
-void setLibraryList(){
-	int found_libs = 0;
+std::ostream& libraryMessages(){
+	return thread_messages ? *thread_messages : *lib_messages;
+}
 
-	std::string lib_path;
-	std::cout << "Enter the full path to the libraries folder: ";
-	std::getline(std::cin, lib_path);
+#ifdef HOT_RELOAD_SUPPORT
+std::thread watcher_thread;
+std::atomic<bool> stop_watcher(false);
+#endif
 
-	if(lib_path.empty()){
-		noLibrariesNeeded = true;
-		return;
-	}
+int scanLibraryDir(FunctionTable& table){ // fills lib_list with every shared object from lib_path, returns number of them
+	int found_libs = 0;
 
 	path p(lib_path);
 	try{
 		if( is_directory(p) ){
 			for(directory_entry& x : directory_iterator(p) ){
 				if( x.path().filename().string().find(".so") != std::string::npos ){
-					lib_list.push_back( x.path().string() );
+					table.lib_list.push_back( x.path().string() );
 					found_libs++;
 				}
 			}
 		}
 	}
 	catch(const filesystem_error& exc){
-		std::cout << exc.what() << std::endl;
+		libraryMessages() << exc.what() << std::endl;
 	}
+	return found_libs;
+}
+
+void setLibraryMessages(std::ostream& ost){
+	lib_messages = &ost;
+}
+
+bool setLibraryList(FunctionTable& table){ // returns false if there was no library found
+	libraryMessages() << "Enter the full path to the libraries folder: ";
+	std::getline(std::cin, lib_path);
+
+	if(lib_path.empty()){
+		noLibrariesNeeded = true;
+		return true;
+	}
+
+	int found_libs = scanLibraryDir(table);
 
 	if(found_libs == 0){
-		std::cout << "There was no library found" << std::endl;
-		exit(EXIT_FAILURE);
+		libraryMessages() << "There was no library found" << std::endl;
+		return false;
 	}
 	else{
-		std::cout << std::endl << "Found " << found_libs;
+		libraryMessages() << std::endl << "Found " << found_libs;
 		if(found_libs == 1)
-			std::cout << " library: ";
+			libraryMessages() << " library: ";
 		else
-			std::cout << " libraries: ";
+			libraryMessages() << " libraries: ";
 
-		std::cout << std::endl;
+		libraryMessages() << std::endl;
 	}
-	for(auto& file_path : lib_list)
-		std::cout << "\t" << file_path << std::endl;
+	for(auto& file_path : table.lib_list)
+		libraryMessages() << "\t" << file_path << std::endl;
 
-	std::cout << std::endl;
+	libraryMessages() << std::endl;
+	return true;
 }
 
 
@@ -66,96 +110,316 @@ void setLibraryList(){
    It is not necessary to do. But if user doesn't want to print every function he defined in library, he has to. 
  */
 
-void importFunction(const std::string& name, void* lib_handle){
+bool importFunction(const std::string& name, void* lib_handle, FunctionTable& table){
 	if(name.substr(0, LIB_PREFIX_LENGTH) == LIB_PREFIX){
 #ifndef NDEBUG
-		std::cout << "Loading symbol " << name << std::endl;
+		libraryMessages() << "Loading symbol " << name << std::endl;
 #endif
 		void* sym_handle = dlsym(lib_handle, name.c_str());
 		if(!sym_handle){
-			std::cout << "Error while loading symbol" << name << std::endl;
-			exit(EXIT_FAILURE);
+			libraryMessages() << "Error while loading symbol" << name << std::endl;
+			return false;
 		}
 
-		func_map.insert( {
+		table.func_map.insert( {
 				{ name.substr(LIB_PREFIX_LENGTH) }, // deleting LIB_PREFIX
 				{ sym_handle }
 			});
+#ifdef SHM_CACHE_SUPPORT
+		if(dlsym(lib_handle, (PURE_PREFIX + name.substr(LIB_PREFIX_LENGTH)).c_str()))
+			table.pure_set.insert(name.substr(LIB_PREFIX_LENGTH));
+#endif
+#ifdef FUNC_STATS_SUPPORT
+		const FunctionTable* old_table = func_table.load(); // only the writer replaces the table, so it is safe to read
+		auto old_stats = old_table ? old_table->stats_map.find(name.substr(LIB_PREFIX_LENGTH)) : table.stats_map.end();
+		if(old_table && old_stats != old_table->stats_map.end())
+			table.stats_map[name.substr(LIB_PREFIX_LENGTH)] = old_stats->second;
+		else
+			table.stats_map[name.substr(LIB_PREFIX_LENGTH)] = std::make_shared<FunctionStats>();
+#endif
 	}
 #ifndef NDEBUG
 	else
-		std::cout << "Ignoring symbol " << name << std::endl;
+		libraryMessages() << "Ignoring symbol " << name << std::endl;
 #endif
+	return true;
 }
 
+void closeTable(const FunctionTable* table){
+	int lib_number = 0;
+	for(auto it : table->lib_handle_list){
+		if(dlclose(it)){
+			std::string lib_filename = path(table->lib_list.at(lib_number)).filename().string();
+			libraryMessages() << "Unable to close library " << lib_filename << std::endl;
+		}
+		lib_number++;
+	}
+	delete table;
+}
 
-void importLibraries(){ // this function uses "nm" to load list of functions in shared objects
-	setLibraryList();
-
-	if(noLibrariesNeeded)
-		return;
+/* Loads every library from table.lib_list and fills func_map. With HOT_RELOAD_SUPPORT every library is loaded from
+   temporary copy of it: dlopen() returns already loaded object for the same path, so that is the only way
+   to get new version of library while old one is still in use. Also it keeps the process alive if library is overwritten in place.
+ */
+FILE* openSymbolList(const std::string& lib_file, pid_t& pid){ // output of "nm -D", closed by closeSymbolList()
+	int fds[2];
+	if(pipe2(fds, O_CLOEXEC))
+		return nullptr;
 
-	for(auto it=lib_list.begin(); it != lib_list.end(); it++)
-	{
-		lib_handle_list.push_back( // load library
-			dlopen((*it).c_str(), RTLD_NOW) ); // or RTLD_LAZY?
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+	char* const argv[] = { const_cast<char*>("nm"), const_cast<char*>("-D"), const_cast<char*>("--"),
+			       const_cast<char*>(lib_file.c_str()), nullptr }; // no shell, so any file name is passed as is
+	int error = posix_spawnp(&pid, "nm", &actions, nullptr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[1]);
 
-		if(!lib_handle_list.back()){ // check if last loaded library was really loaded
-			std::cout << "Error while loading library at " << *it << std::endl;
-			exit(EXIT_FAILURE);
-		}
+	FILE* output = error ? nullptr : fdopen(fds[0], "r");
+	if(!output){
+		close(fds[0]);
+		if(!error)
+			waitpid(pid, nullptr, 0);
 	}
+	return output;
+}
+
+void closeSymbolList(FILE* output, pid_t pid){
+	fclose(output);
+	waitpid(pid, nullptr, 0);
+}
 
+bool loadLibraries(FunctionTable& table){ // this function uses "nm" to load list of functions in shared objects
 	/* Dirty way to load functions from library without user typing functions names:
-	   1. Call nm -D and parse output file to retrieve symbol names
+	   1. Call nm -D and parse its output to retrieve symbol names. Output is read from pipe, so evaluators that reload
+	   at the same time don't share any file
 	   2. Try to load every one of them - if successfully, make table of "function name - function address", we will need it later
 	   when parsing functions
 	 */
 
-	std::string nm_string = std::string("nm -D ");
-	std::string pipe = std::string(" > /tmp/func_names.txt");
-
-	int handle_number = 0;
-	for(auto lib_filepath_it = lib_list.begin(); lib_filepath_it != lib_list.end(); lib_filepath_it++, handle_number++){
-		std::string command = nm_string + *lib_filepath_it + pipe;
-		system(command.c_str());
+	for(auto lib_filepath_it = table.lib_list.begin(); lib_filepath_it != table.lib_list.end(); lib_filepath_it++){
+		std::string load_path = *lib_filepath_it;
+#ifdef HOT_RELOAD_SUPPORT
+		try{
+			load_path = (temp_directory_path() / unique_path("%%%%-%%%%-" + path(*lib_filepath_it).filename().string())).string();
+			copy_file(*lib_filepath_it, load_path);
+		}
+		catch(const filesystem_error& exc){
+			libraryMessages() << exc.what() << std::endl;
+			return false;
+		}
+#endif
 
-		std::ifstream handle_sym_names = std::ifstream("/tmp/func_names.txt");
-		if(!handle_sym_names.is_open()){
-			std::cout << "Error while opening /tmp/func_names.txt..." << std::endl;
-			system("rm -f /tmp/func_names.txt");
-			exit(EXIT_FAILURE);
+		void* lib_handle = dlopen(load_path.c_str(), RTLD_NOW); // or RTLD_LAZY?
+		if(!lib_handle){ // check if library was really loaded
+			libraryMessages() << "Error while loading library at " << *lib_filepath_it << std::endl;
+#ifdef HOT_RELOAD_SUPPORT
+			remove(load_path);
+#endif
+			return false;
 		}
+		table.lib_handle_list.push_back(lib_handle);
 
-		char line[100];
-		while(!handle_sym_names.eof()){
-			handle_sym_names.getline(line, 100);
+#ifdef SHM_CACHE_SUPPORT
+		std::ifstream lib_file(load_path, std::ios::binary); // cached results are valid only for the same libraries
+		std::string lib_contents((std::istreambuf_iterator<char>(lib_file)), std::istreambuf_iterator<char>());
+		table.fingerprint = hashBytes(lib_contents.data(), lib_contents.size(), table.fingerprint);
+#endif
+
+		pid_t nm_pid;
+		FILE* handle_sym_names = openSymbolList(load_path, nm_pid);
+		if(!handle_sym_names){
+			libraryMessages() << "Error while running nm for " << *lib_filepath_it << std::endl;
+#ifdef HOT_RELOAD_SUPPORT
+			remove(load_path);
+#endif
+			return false;
+		}
 
+		bool imported = true;
+		char line[256];
+		while(imported && fgets(line, sizeof(line), handle_sym_names)){
 			std::string str_line = std::string(line);
+			if(!str_line.empty() && str_line.back() == '\n')
+				str_line.pop_back();
 
 			if(str_line.empty())
 				break;
 
 			std::string name = str_line.substr(str_line.find_last_of(' ') + 1);
 
-			importFunction(name, lib_handle_list.at(handle_number));
+			imported = importFunction(name, lib_handle, table);
 		}
 		
-		handle_sym_names.close();
+		closeSymbolList(handle_sym_names, nm_pid); // nm has read the file, so it can be removed now
+#ifdef HOT_RELOAD_SUPPORT
+		remove(load_path); // library stays mapped after removing the file
+#endif
+		if(!imported)
+			return false;
 	}
-	system("rm -f /tmp/func_names.txt");
+	return true;
 }
 
-void closeLibraries(){
-	if(noLibrariesNeeded)
+const FunctionTable* readLockFunctionTable(){
+	if(lock_depth++)
+		return locked_table;
+	locked_epoch = reader_epoch.load() & 1;
+	active_readers[locked_epoch].fetch_add(1);
+	locked_table = func_table.load();
+	return locked_table;
+}
+
+void readUnlockFunctionTable(){
+	if(--lock_depth)
 		return;
+	locked_table = nullptr;
+	active_readers[locked_epoch].fetch_sub(1);
+}
 
-	int lib_number = 0;
-	for(auto it : lib_handle_list){
-		if(dlclose(it)){
-			std::string lib_filename = path(lib_list.at(lib_number).begin(), lib_list.at(lib_number).end()).filename().string();
-			std::cout << "Unable to close library " << lib_filename << std::endl;
+const FunctionTable* lockedTable(){ // lookup without the lock finds nothing in release build
+	assert(lock_depth);
+	return lock_depth ? locked_table : nullptr;
+}
+
+void* findFunction(const std::string& name){
+	const FunctionTable* table = lockedTable();
+	if(!table)
+		return nullptr;
+
+	auto it = table->func_map.find(name);
+	return it == table->func_map.end() ? nullptr : it->second;
+}
+
+#ifdef SHM_CACHE_SUPPORT
+bool isPureFunction(const std::string& name){
+	const FunctionTable* table = lockedTable();
+	return table && table->pure_set.count(name);
+}
+
+uint64_t libraryFingerprint(){
+	const FunctionTable* table = lockedTable();
+	return table ? table->fingerprint : 0;
+}
+#endif
+
+#ifdef FUNC_STATS_SUPPORT
+FunctionStats* findFunctionStats(const std::string& name){
+	const FunctionTable* table = lockedTable();
+	if(!table)
+		return nullptr;
+
+	auto it = table->stats_map.find(name);
+	return it == table->stats_map.end() ? nullptr : it->second.get();
+}
+#endif
+
+void synchronizeReaders(){ // grace period: returns when no reader can hold table that was replaced before the call
+	for(int i = 0; i < 2; i++){
+		unsigned old_epoch = reader_epoch.fetch_add(1) & 1;
+		while(active_readers[old_epoch].load() != 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+#ifdef HOT_RELOAD_SUPPORT
+void reloadLibraries(){ // builds new table from scratch, old one is closed after all of its readers are done
+	FunctionTable* table = new FunctionTable;
+	if(scanLibraryDir(*table) == 0 || !loadLibraries(*table)){
+		libraryMessages() << "Reloading libraries failed, keeping previously loaded functions" << std::endl;
+		closeTable(table);
+		return;
+	}
+
+	const FunctionTable* old_table = func_table.exchange(table);
+	synchronizeReaders();
+	closeTable(old_table);
+
+	libraryMessages() << "Reloaded " << table->lib_list.size() << " libraries, "
+		  << table->func_map.size() << " functions" << std::endl;
+}
+
+void watchLibraries(int inotify_fd){
+	alignas(struct inotify_event) char buf[4096];
+	struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+	bool pending = false;
+	std::ostringstream messages;
+	thread_messages = &messages;
+
+	while(!stop_watcher.load()){
+		int ready = poll(&pfd, 1, pending ? RELOAD_DELAY_MS : 200);
+		if(ready > 0){
+			ssize_t len = read(inotify_fd, buf, sizeof(buf));
+			for(char* ptr = buf; len > 0 && ptr < buf + len; ){
+				const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(ptr);
+				if(event->len && std::string(event->name).find(".so") != std::string::npos)
+					pending = true;
+				ptr += sizeof(struct inotify_event) + event->len;
+			}
 		}
-		lib_number++;
+		else if(ready == 0 && pending){ // library is written in several steps, so wait until directory is quiet
+			reloadLibraries();
+			pending = false;
+
+			std::string text = messages.str(); // stderr is unbuffered, so whole report is written at once
+			fwrite(text.data(), 1, text.size(), stderr);
+			messages.str("");
+		}
+	}
+	close(inotify_fd);
+}
+
+void stopWatcher(){
+	if(watcher_thread.joinable()){
+		stop_watcher.store(true);
+		watcher_thread.join();
+	}
+}
+
+void startWatcher(){
+	int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify_fd < 0 ||
+	   inotify_add_watch(inotify_fd, lib_path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0){
+		libraryMessages() << "Unable to watch " << lib_path << ", libraries won't be reloaded" << std::endl;
+		if(inotify_fd >= 0)
+			close(inotify_fd);
+		return;
+	}
+	watcher_thread = std::thread(watchLibraries, inotify_fd);
+	atexit(stopWatcher); // thread has to be joined before it is destroyed, even if exit() is called
+}
+#endif
+
+void importLibraries(){
+	FunctionTable* table = new FunctionTable;
+	bool found_libs = setLibraryList(*table);
+
+	if(noLibrariesNeeded){
+		func_table.store(table);
+		return;
+	}
+
+	if(!found_libs || !loadLibraries(*table)){ // expressions without functions still can be evaluated
+		libraryMessages() << "Continuing without libraries" << std::endl;
+		closeTable(table);
+		table = new FunctionTable;
 	}
+
+	func_table.store(table);
+#ifdef HOT_RELOAD_SUPPORT
+	startWatcher();
+#endif
 }
+
+void closeLibraries(){
+#ifdef HOT_RELOAD_SUPPORT
+	stopWatcher();
+#endif
+	const FunctionTable* table = func_table.exchange(nullptr);
+	if(!table)
+		return;
+
+	synchronizeReaders();
+	closeTable(table);
+}
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+#include "meta.hpp"
+#include "funcstats.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <iostream>
+
+#ifdef LIB_SUPPORT
+struct FunctionTable{ // never modified after it was published, reload creates new table instead
+	std::unordered_map<std::string, void*> func_map; // hash table of "function name - function pointer"
+	std::vector<std::string> lib_list; // contains full paths to libraries
+	std::vector<void*> lib_handle_list;
+#ifdef SHM_CACHE_SUPPORT
+	std::unordered_set<std::string> pure_set; // functions whose result depends only on arguments
+	uint64_t fingerprint = 0; // hash of contents of all libraries
+#endif
+#ifdef FUNC_STATS_SUPPORT
+	std::unordered_map<std::string, std::shared_ptr<FunctionStats>> stats_map; // shared with previous table, so reload keeps statistics
+#endif
+};
+
+void setLibraryMessages(std::ostream& ost); // std::cout by default
+void importLibraries();
+void closeLibraries();
+
+/* Every evaluation has to be done between these two calls: functions are looked up in the table that was current
+   at the moment of readLockFunctionTable(), and this table (and its libraries) won't be closed until readUnlockFunctionTable().
+   Neither of them takes locks, so evaluation never waits for reload. Calls may be nested, inner ones see the same table.
+   Lookups below are allowed only while the table is locked: table of unlocked reader may be closed by reload at any moment.
+ */
+const FunctionTable* readLockFunctionTable();
+void readUnlockFunctionTable();
+void* findFunction(const std::string& name); // returns nullptr if there is no such function in locked table
+#ifdef SHM_CACHE_SUPPORT
+bool isPureFunction(const std::string& name);
+uint64_t libraryFingerprint(); // fingerprint of locked table
+#endif
+#ifdef FUNC_STATS_SUPPORT
+FunctionStats* findFunctionStats(const std::string& name);
+#endif
+#endif
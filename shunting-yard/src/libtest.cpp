@@ -1,3 +1,6 @@
 extern "C" double impFunction(){
 	return 666.666;
 }
+
+extern "C" const int pureFunction = 1; // impFunction() always returns the same value, so its results can be cached
+
@@ -1,5 +1,10 @@
 #include "meta.hpp"
 #include "token.hpp"
+#include "importlib.hpp"
+#include "shmcache.hpp"
+#include "shunting.hpp"
+#include "aggregate.hpp"
+#include "programfile.hpp"
 #include <list>
 #include <stack>
 #include <vector>
@@ -10,39 +15,46 @@
 #include <iostream>
 #include <iterator>
 #include <cstddef>
-
-#ifdef LIB_SUPPORT
-extern void importLibraries();
-extern void closeLibraries();
-#endif
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
 
 std::list<Token*> tok_list; // list of tokens
 std::stack<Token*> tok_stack; // in terms of shunting yard algorithm, it is operator stack
 std::list<Token*> tok_queue; // in terms of shunting yard algorithm, this variable functions as operands-and-operators queue
+std::vector<Token*> tok_pool; // owns every token of current expression, so nothing leaks when processing stops on error
 std::string expr;
 
-inline void input_error_detected(std::string&& message=""){ // use it to specify errors while processing expression and its elements
-	std::cout << "Expression input error" << message << std::endl;
-	exit(1);
+
+inline Token* addToken(Token* tok){
+	tok_pool.push_back(tok);
+	return tok;
 }
 
-inline void getInput(){
-#ifdef LIB_SUPPORT
-	importLibraries();
-#endif
-	std::cout << "Enter expression: ";
-	std::getline(std::cin, expr);
+inline void input_error_detected(STATUS status){ // use it to report errors while processing expression and its elements
+	std::cout << "Expression input error: " << statusMessage(status) << std::endl;
+}
+
+inline bool getInput(){ // returns false when there are no more expressions
+	do{
+		std::cout << "Enter expression: ";
+		if(!std::getline(std::cin, expr))
+			return false;
+	} while(expr.empty());
+	return true;
 }
 
-void createList(){ // creates list of tokens(tok_list)
+STATUS createList(){ // creates list of tokens(tok_list)
 	bool incr_flag=false;
 	for(auto string_it=expr.begin(); string_it<expr.end(); ){
 
 		if(*string_it=='(' || *string_it==')')
-			tok_list.push_back( new Brace(string_it) ), incr_flag=true;
+			tok_list.push_back( addToken(new Brace(string_it)) ), incr_flag=true;
 
 		else if(Operator::isOperator(string_it))
-			tok_list.push_back( new Operator(string_it) );
+			tok_list.push_back( addToken(new Operator(string_it)) );
 
 		else if(isdigit(*string_it)){
 			auto substring_it=string_it;
@@ -51,7 +63,7 @@ void createList(){ // creates list of tokens(tok_list)
 				substring_it++;
 
 			std::string substring(string_it, substring_it);
-			tok_list.push_back( new Number(std::stof(substring, nullptr)) );
+			tok_list.push_back( addToken(new Number(strtof(substring.c_str(), nullptr))) );
 			string_it=substring_it;
 		}
 #ifdef LIB_SUPPORT
@@ -62,15 +74,18 @@ void createList(){ // creates list of tokens(tok_list)
 				lex_name += *string_it;
 
 			if( *string_it == '('){
-				tok_list.push_back(new Function(lex_name));
+				Function* func = new Function(lex_name);
+				tok_list.push_back(addToken(func));
+				if(!func->isLoaded())
+					return STATUS::UNKNOWN_FUNCTION;
 				string_it += 2; // without function arguments support, it shifts for 2 symbols to cover parentheses
 			}
-			else{
-				input_error_detected(": no parentheses detected for " + lex_name + "() function");
-				exit(EXIT_FAILURE);
-			}
+			else
+				return STATUS::NO_PARENTHESES;
 		}
 #endif
+		else if(!isspace(*string_it))
+			return STATUS::UNKNOWN_SYMBOL;
 
 		if(*string_it==' ' || incr_flag) // this condition is put instead of loop increment
 			string_it++, incr_flag=false;
@@ -80,9 +95,10 @@ void createList(){ // creates list of tokens(tok_list)
 		std::cout << *tok;
 	std::cout << std::endl;
 #endif
+	return STATUS::OK;
 }
 
-void parseList(){ // shunting-yard algorithm implementation itself
+STATUS parseList(){ // shunting-yard algorithm implementation itself
 	for(auto tok_it=tok_list.begin(); tok_it!=tok_list.end(); tok_it++){
 		auto token=*tok_it;
 		TAG token_tag=token->getTag();
@@ -97,14 +113,11 @@ void parseList(){ // shunting-yard algorithm implementation itself
 			Operator& op_token = *static_cast<Operator*>(token);
 			while(!tok_stack.empty()){
 				TAG stack_top_tag = tok_stack.top()->getTag();
-				const Operator& top_oper = *dynamic_cast<Operator*>(tok_stack.top());
-
-				if(&top_oper == nullptr)
-					input_error_detected();
+				const Operator* top_oper = stack_top_tag == TAG::OPERATOR ? static_cast<Operator*>(tok_stack.top()) : nullptr;
 
 				if(  (stack_top_tag == TAG::FUNCTION ||
-				     (stack_top_tag == TAG::OPERATOR && top_oper > op_token ) ||
-				      (stack_top_tag == TAG::OPERATOR && top_oper == op_token && !top_oper.getAssoc() ) )){
+				     (top_oper && *top_oper > op_token ) ||
+				      (top_oper && *top_oper == op_token && !top_oper->getAssoc() ) )){
 					tok_queue.push_back(tok_stack.top());
 					tok_stack.pop();
 				}
@@ -116,7 +129,8 @@ void parseList(){ // shunting-yard algorithm implementation itself
 		else if(token_tag == TAG::LEFT_BRACE){
 #ifdef NEG_SUPPORT
 			auto saved_tok_it = tok_it; //we have to remove excessive tokens so that they don't interfere operations on stack/queue
-			tok_it++;
+			if(++tok_it == tok_list.end())
+				return STATUS::PARENTHESIS_MISMATCH;
 			auto next_token=*tok_it;
 			if(next_token->getTag()==TAG::OPERATOR &&
 			   static_cast<Operator*>(next_token)->getOperatorTag()==OPERATORS::SUBSTRACT){
@@ -124,9 +138,12 @@ void parseList(){ // shunting-yard algorithm implementation itself
 				tok_list.erase(saved_tok_it);
 
 				saved_tok_it = tok_it;
-				tok_it++;
+				if(++tok_it == tok_list.end())
+					return STATUS::MINUS_BEFORE_UNALLOWED;
 				next_token=*tok_it;
 				tok_list.erase(saved_tok_it);
+				if(std::next(tok_it) == tok_list.end())
+					return STATUS::PARENTHESIS_MISMATCH;
 
 				if(next_token->getTag()==TAG::NUMBER){
 					static_cast<Number*>(next_token)->negate();
@@ -148,10 +165,8 @@ void parseList(){ // shunting-yard algorithm implementation itself
                                                     // in case you want to handle parenthesis mismatch, you have to specify that you might encounter
 					            // input error here
 				}
-				else{
-					input_error_detected(": minus sign before unallowed token");
-					exit(EXIT_FAILURE);
-				}
+				else
+					return STATUS::MINUS_BEFORE_UNALLOWED;
 			}
 			else{
 				tok_it--;
@@ -175,40 +190,18 @@ void parseList(){ // shunting-yard algorithm implementation itself
 		tok_queue.push_back(tok_stack.top());
 		tok_stack.pop();
 	}
+	return STATUS::OK;
 }
 
-Number& performOperation(Number& first_operand, Number& second_operand, Operator& oper){
-	double garbage_ptr;
-
-	switch(oper.getOperatorTag()){
-	case OPERATORS::ADD:
-		return *new Number(first_operand + second_operand);
-		break;
-	case OPERATORS::SUBSTRACT:
-		return *new Number(first_operand - second_operand);
-		break;
-	case OPERATORS::MULTIPLY:
-		return *new Number(first_operand * second_operand);
-		break;
-	case OPERATORS::DIVIDE:
-		return *new Number(first_operand / second_operand);
-		break;
-	case OPERATORS::XOR:
-		if( modf(first_operand.getNum(), &garbage_ptr) == 0.0 &&
-		    modf(second_operand.getNum(), &garbage_ptr ) == 0.0 )
-			return *new Number(static_cast<int>(first_operand.getNum()) ^
-					   static_cast<int>(second_operand.getNum()) );
-		else
-			input_error_detected(": xor can't be applied to non-integral values");
-		break;
-	}
-	std::cout << "Cannot perform operation on " << first_operand.getNum() << " " << second_operand.getNum()
-		  << " " << oper.getOperatorTag() << std::endl;
-	exit(EXIT_FAILURE);
-	return *new Number(NAN);
+STATUS performOperation(Number& first_operand, Number& second_operand, Operator& oper, Number*& result){
+	double num;
+	STATUS status = calculate(first_operand.getNum(), second_operand.getNum(), oper.getOperatorTag(), num);
+	if(status == STATUS::OK)
+		result = static_cast<Number*>(addToken(new Number(num)));
+	return status;
 }
 
-void parseRPN(){ // parses RPN queue(tok_queue) and prints the final result of expression
+STATUS parseRPN(double& result){ // parses RPN queue(tok_queue) and returns the final result of expression
 	using LIST_IT = std::list<Token*>::iterator;
 
 	LIST_IT first_operand,
@@ -222,17 +215,23 @@ void parseRPN(){ // parses RPN queue(tok_queue) and prints the final result of e
 	for(it=tok_queue.begin(); it != tok_queue.end(); it++){
 		if( (*it)->getTag() == TAG::OPERATOR){
 
+			if(it == tok_queue.begin() || std::prev(it) == tok_queue.begin())
+				return STATUS::MALFORMED_EXPRESSION;
+
 			first_operand=std::prev(it, 2);
 			second_operand=std::prev(it, 1);
 
 
 			if( (*first_operand)->getTag() != TAG::NUMBER ||
 			    (*second_operand)->getTag() != TAG::NUMBER)
-				input_error_detected();
-
-			Number& result=performOperation(static_cast<Number&>(**first_operand),
-							static_cast<Number&>(**second_operand),
-							static_cast<Operator&>(**it) );
+				return STATUS::MALFORMED_EXPRESSION;
+
+			Number* result;
+			STATUS status = performOperation(static_cast<Number&>(**first_operand),
+							 static_cast<Number&>(**second_operand),
+							 static_cast<Operator&>(**it), result);
+			if(status != STATUS::OK)
+				return status;
 			/*it_copy=it;
 			  it_copy++;
 
@@ -249,30 +248,346 @@ void parseRPN(){ // parses RPN queue(tok_queue) and prints the final result of e
 			else
 			it=tok_queue.insert(it_copy, static_cast<const Token*>(&result));*/
 
-			it=tok_queue.insert(it, static_cast<Token*>(&result) );
+			it=tok_queue.insert(it, static_cast<Token*>(result) );
 		}
 #ifdef LIB_SUPPORT
 		else if( (*it)->getTag() == TAG::FUNCTION){
 			Function& func_tok = static_cast<Function&>(**it);
 			double result = func_tok.call();
 			it = tok_queue.erase(it);
-			it = tok_queue.insert(it, static_cast<Token*>(new Number(result)));
+			it = tok_queue.insert(it, addToken(new Number(result)));
+		}
+#endif
+	}
+
+	if(tok_queue.size() != 1 || tok_queue.front()->getTag() != TAG::NUMBER)
+		return STATUS::MALFORMED_EXPRESSION;
+	result = static_cast<Number&>(*tok_queue.front()).getNum();
+	return STATUS::OK;
+}
+
+#ifdef SHM_CACHE_SUPPORT
+bool getCacheKey(CacheKey& key){ // returns false if result of expression can change between evaluations
+	bool uses_functions = false;
+#ifdef LIB_SUPPORT
+	for(auto tok : tok_list)
+		if(tok->getTag() == TAG::FUNCTION){
+			if(!static_cast<Function*>(tok)->isPure())
+				return false;
+			uses_functions = true;
 		}
 #endif
+	key = makeCacheKey(expr, uses_functions ? libraryFingerprint() : 0); // constant expressions don't depend on libraries
+	return true;
+}
+#endif
+
+void clearTokens(){
+	for(auto tok : tok_pool)
+		delete tok;
+	tok_pool.clear();
+	tok_queue.clear();
+	tok_list.clear();
+	tok_stack = std::stack<Token*>();
+}
+
+struct StreamEvaluator{ // evaluates operators as soon as shuntingYard() gives them
+	std::vector<double> operands;
+	double result;
+#ifdef SHM_CACHE_SUPPORT
+	bool uses_functions;
+	bool pure; // all functions are pure, so result can be cached
+#endif
+
+	STATUS number(double num){
+		operands.push_back(num);
+		return STATUS::OK;
+	}
+
+	STATUS variable(const std::string& name, bool negated){ // there are no variables outside of aggregate mode
+		return STATUS::NO_PARENTHESES;
+	}
+
+	STATUS function(const std::string& name, bool negated){
+#ifdef LIB_SUPPORT
+		Function func(name);
+		if(!func.isLoaded())
+			return STATUS::UNKNOWN_FUNCTION;
+#ifdef SHM_CACHE_SUPPORT
+		uses_functions = true;
+		pure = pure && func.isPure();
+#endif
+		if(negated)
+#ifdef NEG_SUPPORT
+			func.negate();
+#else
+			return STATUS::MINUS_BEFORE_UNALLOWED;
+#endif
+		operands.push_back(func.call());
+		return STATUS::OK;
+#else
+		return STATUS::UNKNOWN_FUNCTION;
+#endif
+	}
+
+	STATUS apply(const Operator& oper){
+		if(operands.size() < 2)
+			return STATUS::MALFORMED_EXPRESSION;
+
+		double second_operand = operands.back();
+		operands.pop_back();
+		return calculate(operands.back(), second_operand, oper.getOperatorTag(), operands.back());
+	}
+
+	STATUS finish(){
+		if(operands.size() != 1)
+			return STATUS::MALFORMED_EXPRESSION;
+		result = operands.back();
+		return STATUS::OK;
+	}
+};
+
+StreamEvaluator stream_evaluator; // kept between expressions to avoid allocations
+
+/* One-pass alternative to createList()/parseList()/parseRPN(), see shuntingYard() */
+bool evaluateStream(std::istream& in, double& result, STATUS& status, size_t& position){
+	stream_evaluator.operands.clear();
+#ifdef SHM_CACHE_SUPPORT
+	stream_evaluator.uses_functions = false;
+	stream_evaluator.pure = true;
+#endif
+	if(!shuntingYard(in.rdbuf(), stream_evaluator, status, position))
+		return false;
+	if(status == STATUS::OK)
+		result = stream_evaluator.result;
+	return true;
+}
+
+#ifdef SHM_CACHE_SUPPORT
+std::istringstream row_stream;
+
+/* Batch row is looked up with the same keys as in evaluateInput(). Functions aren't known before the row is parsed,
+   so key of constant expression is tried first and key with fingerprint of libraries only if row has any names.
+   Stream mode is never cached: it is meant for expressions too large to keep their text.
+ */
+bool evaluateCachedRow(const std::string& text, double& result, STATUS& status, size_t& position){
+	bool has_names = std::any_of(text.begin(), text.end(), [](unsigned char c){ return isalpha(c); });
+	if(lookupResult(makeCacheKey(text, 0), result) ||
+	   (has_names && lookupResult(makeCacheKey(text, libraryFingerprint()), result))){
+		status = STATUS::OK;
+		return true;
+	}
+
+	row_stream.clear();
+	row_stream.str(text + '\n'); // empty row is still an expression
+	if(!evaluateStream(row_stream, result, status, position))
+		return false;
+	if(status == STATUS::OK && stream_evaluator.pure)
+		storeResult(makeCacheKey(text, stream_evaluator.uses_functions ? libraryFingerprint() : 0), result);
+	return true;
+}
+#endif
+
+bool evaluateInput(double& result, STATUS& status){ // reads, parses and evaluates next expression; returns false if there is none
+	if(!getInput())
+		return false;
+#ifdef LIB_SUPPORT
+	readLockFunctionTable(); // libraries can be reloaded meanwhile, but this expression is finished with the old ones
+#endif
+	status = createList();
+#ifdef SHM_CACHE_SUPPORT
+	CacheKey key;
+	bool cacheable = status == STATUS::OK && getCacheKey(key);
+	if(cacheable && lookupResult(key, result)){
+#ifndef NDEBUG
+		std::cout << "Result is taken from shared cache" << std::endl;
+#endif
+	}
+	else if(status == STATUS::OK && (status = parseList()) == STATUS::OK &&
+		(status = parseRPN(result)) == STATUS::OK && cacheable)
+		storeResult(key, result);
+#else
+	if(status == STATUS::OK)
+		status = parseList();
+	if(status == STATUS::OK)
+		status = parseRPN(result);
+#endif
+#ifdef LIB_SUPPORT
+	readUnlockFunctionTable();
+#endif
+	clearTokens();
+	return true;
+}
+
+bool evaluateStreamInput(double& result, STATUS& status){
+	size_t position;
+	bool evaluated;
+	do{
+		std::cout << "Enter expression: " << std::flush;
+		if(std::cin.rdbuf()->sgetc() == EOF) // table is locked only after row arrives, waiting reader would hold up reload
+			return false;
+#ifdef LIB_SUPPORT
+		readLockFunctionTable();
+#endif
+		evaluated = evaluateStream(std::cin, result, status, position);
+#ifdef LIB_SUPPORT
+		readUnlockFunctionTable();
+#endif
+	} while(evaluated && status == STATUS::EMPTY_EXPRESSION);
+	return evaluated;
+}
+
+void evaluateBatch(){ // every input row gets output row "row<TAB>result<TAB>error", errors don't stop the batch
+	double result;
+	STATUS status;
+	size_t position;
+	bool evaluated;
+#ifdef SHM_CACHE_SUPPORT
+	std::string text;
+#endif
+
+	for(size_t row = 1; ; row++){
+#ifdef SHM_CACHE_SUPPORT
+		if(!std::getline(std::cin, text)) // whole row is needed for its cache key
+			break;
+#else
+		if(std::cin.rdbuf()->sgetc() == EOF) // as in evaluateStreamInput(), idle batch mustn't hold up reload
+			break;
+#endif
+#ifdef LIB_SUPPORT
+		readLockFunctionTable();
+#endif
+#ifdef SHM_CACHE_SUPPORT
+		evaluated = evaluateCachedRow(text, result, status, position);
+#else
+		evaluated = evaluateStream(std::cin, result, status, position);
+#endif
+#ifdef LIB_SUPPORT
+		readUnlockFunctionTable();
+#endif
+		if(!evaluated)
+			break;
+
+		if(status == STATUS::OK)
+			std::cout << row << '\t' << result << "\t\n";
+		else
+			std::cout << row << "\t\tposition " << position << ": " << statusMessage(status) << '\n';
 	}
+	std::cout << std::flush;
+}
 
-	if(tok_queue.size() != 1)
-		input_error_detected();
+void evaluateAggregate(){ // prints only aggregated value, never results of separate rows
+	double result;
+	uint64_t rows, errors;
+	size_t position;
+
+#ifdef LIB_SUPPORT
+	readLockFunctionTable(); // functions of the query are used by all worker threads
+#endif
+	STATUS status = aggregateQuery(std::cin, result, rows, errors, position);
+#ifdef LIB_SUPPORT
+	readUnlockFunctionTable();
+#endif
+
+	if(status == STATUS::OK)
+		std::cout << std::setprecision(std::numeric_limits<double>::digits10) << result << std::endl
+			  << "rows: " << rows << ", skipped rows: " << errors << std::endl;
 	else
-		std::cout << static_cast<Number&>(*tok_queue.front()).getNum() << std::endl;
+		std::cout << "Query error at position " << position << ": " << statusMessage(status) << std::endl;
+}
+
+void compilePrograms(const std::string& path, std::ostream& messages){ // one expression per row, all of them are saved to one file
+	std::vector<SourceProgram> programs;
+	std::string text;
+	size_t position;
+
+	for(size_t row = 1; std::getline(std::cin, text); row++){
+		if(text.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		Program program;
+#ifdef LIB_SUPPORT
+		readLockFunctionTable();
+#endif
+		STATUS status = compileProgram(text, {}, program, position);
+#ifdef LIB_SUPPORT
+		readUnlockFunctionTable();
+#endif
+		if(status == STATUS::OK)
+			programs.push_back({ row, text, std::move(program) });
+		else
+			messages << "Row " << row << " skipped, position " << position << ": " << statusMessage(status) << std::endl;
+	}
+	if(writeProgramFile(path, programs, messages))
+		std::cout << programs.size() << " programs saved to " << path << std::endl;
 }
 
-int main(){
+void evaluatePrograms(const std::string& path, std::ostream& messages){ // output rows are the same as in batch mode for the input of --compile
+	ProgramFile file;
+	double result;
+
+#ifdef LIB_SUPPORT
+	readLockFunctionTable(); // functions of the file are resolved once in this table
+#endif
+	if(file.load(path, messages))
+		for(size_t i = 0; i < file.getCount(); i++){
+			STATUS status = evaluateProgram(file.getProgram(i), nullptr, 0, result);
+			if(status == STATUS::OK)
+				std::cout << file.getRow(i) << '\t' << result << "\t\n";
+			else
+				std::cout << file.getRow(i) << "\t\t" << statusMessage(status) << '\n';
+		}
+	file.close(); // functions point into libraries of the locked table
+#ifdef LIB_SUPPORT
+	readUnlockFunctionTable();
+#endif
+	std::cout << std::flush;
+}
+
+int main(int argc, char* argv[]){
+	std::string mode = argc > 1 ? argv[1] : "";
+	bool streaming = mode == "--stream"; // evaluate while reading, for very large expressions
+	bool batch = mode == "--batch"; // one expression per row, results and errors are written as columns
+	bool aggregate = mode == "--aggregate"; // one query like "sum(x * y)", then columns header and rows of values
+	bool compile = mode == "--compile"; // expressions are compiled and saved to file given as the next argument
+	bool load = mode == "--load"; // compiled expressions are mapped from file and evaluated without parsing
+	if((compile || load) && argc < 3){
+		std::cout << "Usage: " << argv[0] << ' ' << mode << " <programs file>" << std::endl;
+		return 1;
+	}
+
+	std::ios::sync_with_stdio(false);
 	Operator::initOperatorsTable();
-	getInput();
-	createList();
-	parseList();
-	parseRPN();
+	std::ostream& messages = batch || aggregate || compile || load ? std::cerr : std::cout; // output contains only results
+#ifdef LIB_SUPPORT
+	setLibraryMessages(messages);
+	importLibraries();
+#endif
+#ifdef SHM_CACHE_SUPPORT
+	attachResultCache(SHM_CACHE_NAME, SHM_CACHE_ENTRIES, messages);
+#endif
+	double result;
+	STATUS status;
+	if(batch)
+		evaluateBatch();
+	else if(aggregate)
+		evaluateAggregate();
+	else if(compile)
+		compilePrograms(argv[2], messages);
+	else if(load)
+		evaluatePrograms(argv[2], messages);
+	else
+		while(streaming ? evaluateStreamInput(result, status) : evaluateInput(result, status)){
+			if(status == STATUS::OK)
+				std::cout << result << std::endl;
+			else
+				input_error_detected(status);
+		}
+#ifdef SHM_CACHE_SUPPORT
+	detachResultCache();
+#endif
+#ifdef FUNC_STATS_SUPPORT
+	printFunctionStats(messages);
+#endif
 #ifdef LIB_SUPPORT
 	closeLibraries();
 #endif
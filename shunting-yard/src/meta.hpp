@@ -3,7 +3,23 @@
 //#define NDEBUG
 #define LIB_SUPPORT
 #define NEG_SUPPORT
+//#define FUNC_STATS_SUPPORT // call counters and latency histograms of imported functions(needs LIB_SUPPORT)
+//#define SHM_CACHE_SUPPORT // results of constant expressions and expressions with pure functions are shared between processes
+#define HOT_RELOAD_SUPPORT // libraries folder is watched, changed libraries are reloaded without restart(needs LIB_SUPPORT)
 #define LIB_PREFIX "imp" // prefix of user-defined functions in loaded libraries
                          // all functions in library should start with this prefix, but user should write function names for parser without prefix
 
 #define LIB_PREFIX_LENGTH 3 // length of prefix
+#define PURE_PREFIX "pure" // library marks function impName as pure by exporting any symbol named pureName
+
+#define RELOAD_DELAY_MS 100 // libraries are reloaded only after folder was not changed for this time
+
+#define SHM_CACHE_NAME "/shunting-yard-cache" // name of POSIX shared memory segment
+#define SHM_CACHE_ENTRIES 65536 // size of the cache, rounded up to power of two; existing segment keeps its own size
+#define SHM_CACHE_PROBES 8 // entries checked for one key, the oldest of them is evicted when all are taken
+#define SHM_CACHE_ATTACH_MS 100 // time to wait for another process to initialize the segment before it is considered corrupted
+#define SHM_CACHE_STALE_USES 1000000 // entry being written for this many uses of the cache was left by crashed writer
+
+#define AGGREGATE_BLOCK 1024 // rows evaluated at once in aggregate mode
+#define AGGREGATE_LANES 4 // independent accumulators of every thread, even: 2 doubles fill one SSE register
+#define AGGREGATE_THREADS 0 // threads evaluating aggregate, 0 means one per hardware thread
@@ -0,0 +1,247 @@
+#include "program.hpp"
+#include "shunting.hpp"
+#include <sstream>
+#include <cmath>
+
+struct ProgramCompiler{ // gets operands and operators from shuntingYard() and writes them as instructions
+	Program& program;
+	const std::vector<std::string>& variables;
+	size_t depth;
+
+	void push(OPCODE code, uint32_t index){
+		program.code.push_back({ code, index });
+		if(code == OPCODE::NUMBER || code == OPCODE::VARIABLE || code == OPCODE::FUNCTION)
+			depth++;
+		else if(code == OPCODE::OPERATOR)
+			depth--;
+		if(depth > program.depth)
+			program.depth = depth;
+	}
+
+	STATUS number(double num){
+		program.constants.push_back(num);
+		push(OPCODE::NUMBER, program.constants.size() - 1);
+		return STATUS::OK;
+	}
+
+	STATUS variable(const std::string& name, bool negated){
+		for(size_t i = 0; i < variables.size(); i++)
+			if(variables[i] == name){
+				push(OPCODE::VARIABLE, i);
+				if(negated)
+					push(OPCODE::NEGATE, 0);
+				return STATUS::OK;
+			}
+		return STATUS::UNKNOWN_VARIABLE;
+	}
+
+	STATUS function(const std::string& name, bool negated){
+#ifdef LIB_SUPPORT
+		size_t index = 0;
+		while(index < program.functions.size() && program.functions[index].getName() != name)
+			index++;
+		if(index == program.functions.size()){
+			Function func(name);
+			if(!func.isLoaded())
+				return STATUS::UNKNOWN_FUNCTION;
+			program.functions.push_back(func);
+		}
+		push(OPCODE::FUNCTION, index);
+		if(negated)
+			push(OPCODE::NEGATE, 0);
+		return STATUS::OK;
+#else
+		return STATUS::UNKNOWN_FUNCTION;
+#endif
+	}
+
+	STATUS apply(const Operator& oper){
+		if(depth < 2)
+			return STATUS::MALFORMED_EXPRESSION;
+
+		size_t size = program.code.size(), constants = program.constants.size();
+		if(size >= 2 && program.code[size - 2].code == OPCODE::NUMBER && program.code[size - 1].code == OPCODE::NUMBER){
+			// both operands are the last two constants, so operator is applied once here instead of every evaluation
+			double result;
+			if(calculate(program.constants[constants - 2], program.constants[constants - 1],
+				     oper.getOperatorTag(), result) == STATUS::OK){ // failed operator is left for evaluation to report
+				program.constants.pop_back();
+				program.constants.back() = result;
+				program.code.pop_back();
+				depth--;
+				return STATUS::OK;
+			}
+		}
+		push(OPCODE::OPERATOR, static_cast<uint32_t>(oper.getOperatorTag()));
+		return STATUS::OK;
+	}
+
+	STATUS finish(){
+		if(depth != 1)
+			return STATUS::MALFORMED_EXPRESSION;
+
+		program.depth = depth = 0; // folded operands don't need stack anymore, so depth is counted again
+		for(auto& instr : program.code){
+			if(instr.code == OPCODE::NUMBER || instr.code == OPCODE::VARIABLE || instr.code == OPCODE::FUNCTION)
+				depth++;
+			else if(instr.code == OPCODE::OPERATOR)
+				depth--;
+			if(depth > program.depth)
+				program.depth = depth;
+		}
+		return STATUS::OK;
+	}
+};
+
+STATUS compileProgram(const std::string& text, const std::vector<std::string>& variables, Program& program, size_t& position){
+	std::stringbuf buf(text);
+	ProgramCompiler compiler = { program, variables, 0 };
+	STATUS status;
+
+	program = Program();
+	if(!shuntingYard(&buf, compiler, status, position))
+		return STATUS::EMPTY_EXPRESSION;
+	return status;
+}
+
+ProgramView Program::view() const{
+	return { code.data(), code.size(), constants.data(), constants.size(), functions.data(), functions.size(), depth };
+}
+
+/* Loops over two columns are kept in functions with __restrict parameters: GCC ignores __restrict of local pointers,
+   and without it every such loop gets runtime check for overlapping columns.
+ */
+inline void copyColumn(double* __restrict to, const double* __restrict from, size_t rows){
+	for(size_t r = 0; r < rows; r++)
+		to[r] = from[r];
+}
+
+template<class Op>
+inline void applyColumns(double* __restrict first, const double* __restrict second, size_t rows, Op op){
+	for(size_t r = 0; r < rows; r++)
+		first[r] = op(first[r], second[r]);
+}
+
+void evaluateBlock(const ProgramView& program, const double* const* columns, size_t rows, double* __restrict results, unsigned char* __restrict valid){
+	static thread_local std::vector<double> stack_memory;
+	if(stack_memory.size() < program.depth * rows)
+		stack_memory.resize(program.depth * rows);
+
+	auto level = [&](size_t depth){ // bottom of the stack is the result itself
+		return depth ? stack_memory.data() + (depth - 1) * rows : results;
+	};
+
+	for(size_t r = 0; r < rows; r++)
+		valid[r] = 1;
+
+	size_t depth = 0;
+	for(const Instruction* instr_it = program.code; instr_it != program.code + program.code_size; instr_it++){
+		const Instruction& instr = *instr_it;
+		switch(instr.code){
+		case OPCODE::NUMBER:{
+			double* top = level(depth++);
+			double num = program.constants[instr.index];
+			for(size_t r = 0; r < rows; r++)
+				top[r] = num;
+			break;
+		}
+		case OPCODE::VARIABLE:{
+			copyColumn(level(depth++), columns[instr.index], rows);
+			break;
+		}
+		case OPCODE::FUNCTION:{ // function may return different values, so it is called for every row
+			double* top = level(depth++);
+			const Function& func = program.functions[instr.index];
+			for(size_t r = 0; r < rows; r++)
+				top[r] = func.call();
+			break;
+		}
+		case OPCODE::NEGATE:{
+			double* top = level(depth - 1);
+			for(size_t r = 0; r < rows; r++)
+				top[r] = -top[r];
+			break;
+		}
+		case OPCODE::OPERATOR:{
+			double* first = level(depth - 2);
+			const double* second = level(depth - 1);
+			depth--;
+			switch(static_cast<OPERATORS>(instr.index)){
+			case OPERATORS::ADD:
+				applyColumns(first, second, rows, [](double a, double b){ return a + b; });
+				break;
+			case OPERATORS::SUBSTRACT:
+				applyColumns(first, second, rows, [](double a, double b){ return a - b; });
+				break;
+			case OPERATORS::MULTIPLY:
+				applyColumns(first, second, rows, [](double a, double b){ return a * b; });
+				break;
+			case OPERATORS::DIVIDE:
+				applyColumns(first, second, rows, [](double a, double b){ return a / b; });
+				break;
+			case OPERATORS::XOR:
+				for(size_t r = 0; r < rows; r++){
+					bool integral = first[r] == trunc(first[r]) && second[r] == trunc(second[r]);
+					valid[r] &= integral;
+					first[r] = integral ? static_cast<int>(first[r]) ^ static_cast<int>(second[r]) : NAN;
+				}
+				break;
+			}
+			break;
+		}
+		}
+	}
+}
+
+STATUS evaluateProgram(const ProgramView& program, const double* variables, size_t variables_size, double& result){
+	static thread_local std::vector<double> stack;
+	if(stack.size() < program.depth)
+		stack.resize(program.depth);
+
+	size_t depth = 0;
+	for(const Instruction* instr = program.code; instr != program.code + program.code_size; instr++){
+		bool pushes = instr->code == OPCODE::NUMBER || instr->code == OPCODE::VARIABLE || instr->code == OPCODE::FUNCTION;
+		if((pushes && depth >= program.depth) ||
+		   (instr->code == OPCODE::NEGATE && depth < 1) || (instr->code == OPCODE::OPERATOR && depth < 2))
+			return STATUS::MALFORMED_EXPRESSION;
+
+		switch(instr->code){
+		case OPCODE::NUMBER:
+			if(instr->index >= program.constants_size)
+				return STATUS::MALFORMED_EXPRESSION;
+			stack[depth++] = program.constants[instr->index];
+			break;
+		case OPCODE::VARIABLE:
+			if(instr->index >= variables_size)
+				return STATUS::UNKNOWN_VARIABLE;
+			stack[depth++] = variables[instr->index];
+			break;
+		case OPCODE::FUNCTION:
+			if(instr->index >= program.functions_size)
+				return STATUS::MALFORMED_EXPRESSION;
+			if(!program.functions[instr->index].isLoaded())
+				return STATUS::UNKNOWN_FUNCTION;
+			stack[depth++] = program.functions[instr->index].call();
+			break;
+		case OPCODE::NEGATE:
+			stack[depth - 1] = -stack[depth - 1];
+			break;
+		case OPCODE::OPERATOR:{
+			if(instr->index > static_cast<uint32_t>(OPERATORS::XOR))
+				return STATUS::MALFORMED_EXPRESSION;
+			depth--;
+			STATUS status = calculate(stack[depth - 1], stack[depth], static_cast<OPERATORS>(instr->index), stack[depth - 1]);
+			if(status != STATUS::OK)
+				return status;
+			break;
+		}
+		default:
+			return STATUS::MALFORMED_EXPRESSION;
+		}
+	}
+	if(depth != 1)
+		return STATUS::MALFORMED_EXPRESSION;
+
+	result = stack[0];
+	return STATUS::OK;
+}
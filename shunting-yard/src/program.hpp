@@ -0,0 +1,54 @@
+#pragma once
+#include "meta.hpp"
+#include "token.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum class OPCODE : uint32_t{
+	NUMBER, // pushes constants[index]
+	VARIABLE, // pushes value of variable number index
+	FUNCTION, // pushes result of functions[index]
+	OPERATOR, // replaces two values on top with result of OPERATORS(index)
+	NEGATE // negates value on top
+};
+
+struct Instruction{
+	OPCODE code;
+	uint32_t index;
+};
+
+struct ProgramView{ // program that doesn't own its arrays, they may be inside of mmapped file
+	const Instruction* code;
+	size_t code_size;
+	const double* constants;
+	size_t constants_size;
+	const Function* functions;
+	size_t functions_size;
+	size_t depth; // stack size needed for evaluation
+};
+
+struct Program{ // expression compiled to reverse polish order, it can be evaluated many times without parsing
+	std::vector<Instruction> code;
+	std::vector<double> constants;
+	std::vector<Function> functions; // resolved in function table that was read-locked during compilation
+	size_t depth = 0;
+	ProgramView view() const;
+};
+
+/* variables are names that can be used in expression, their values are given to evaluation in the same order.
+   Operators whose both operands are constant are applied during compilation.
+ */
+STATUS compileProgram(const std::string& text, const std::vector<std::string>& variables, Program& program, size_t& position);
+
+/* Evaluates program for the whole block of rows at once: variable i of row r is columns[i][r]. Every instruction is
+   a loop over the block; loops of numbers, variables, negation and arithmetic operators are vectorized(with cost model
+   set in Makefile), function calls and xor stay scalar. Rows which failed get valid[r] = 0.
+ */
+void evaluateBlock(const ProgramView& program, const double* const* columns, size_t rows, double* __restrict results, unsigned char* __restrict valid);
+
+/* Evaluates program once, variable i is variables[i]. Indices of instructions are checked, so program read from file
+   can't make it read outside of its arrays.
+ */
+STATUS evaluateProgram(const ProgramView& program, const double* variables, size_t variables_size, double& result);
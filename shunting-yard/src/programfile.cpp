@@ -0,0 +1,187 @@
+#include "programfile.hpp"
+#include <fstream>
+#include <cstring>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const char program_file_magic[8] = { 'S', 'Y', 'P', 'R', 'O', 'G', 0, 0 };
+
+size_t alignOffset(size_t offset){
+	return (offset + 7) & ~size_t(7);
+}
+
+template<class T>
+size_t appendArray(std::string& buf, const T* items, size_t count){ // returns offset of the array
+	buf.resize(alignOffset(buf.size()), '\0');
+	size_t offset = buf.size();
+	buf.append(reinterpret_cast<const char*>(items), count * sizeof(T));
+	return offset;
+}
+
+bool writeProgramFile(const std::string& path, const std::vector<SourceProgram>& programs, std::ostream& ost){
+	std::vector<std::string> function_names;
+	std::unordered_map<std::string, uint32_t> function_index;
+	std::vector<ProgramFileEntry> entries(programs.size());
+	std::string buf(sizeof(ProgramFileHeader) + programs.size() * sizeof(ProgramFileEntry), '\0');
+
+	for(size_t i = 0; i < programs.size(); i++){
+		const Program& program = programs[i].program;
+		std::vector<Instruction> code = program.code;
+		for(auto& instr : code) // indices of program's own functions are replaced with indices of the whole file
+			if(instr.code == OPCODE::FUNCTION){
+				std::string name = program.functions[instr.index].getName();
+				auto it = function_index.find(name);
+				if(it == function_index.end()){
+					it = function_index.insert({ name, function_names.size() }).first;
+					function_names.push_back(name);
+				}
+				instr.index = it->second;
+			}
+
+		entries[i].code_offset = appendArray(buf, code.data(), code.size());
+		entries[i].code_size = code.size();
+		entries[i].constants_offset = appendArray(buf, program.constants.data(), program.constants.size());
+		entries[i].constants_size = program.constants.size();
+		entries[i].depth = program.depth;
+		entries[i].row = programs[i].row;
+	}
+
+	std::vector<ProgramFileString> function_refs(function_names.size());
+	size_t functions_offset = appendArray(buf, function_refs.data(), function_refs.size()); // filled below
+	for(size_t i = 0; i < function_names.size(); i++){
+		function_refs[i] = { buf.size(), function_names[i].size() };
+		buf += function_names[i];
+	}
+	for(size_t i = 0; i < programs.size(); i++){
+		entries[i].text = { buf.size(), programs[i].text.size() };
+		buf += programs[i].text;
+	}
+
+	ProgramFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, program_file_magic, sizeof(header.magic));
+	header.version = PROGRAM_FILE_VERSION;
+	header.byte_order = 0x01020304;
+	header.file_size = buf.size();
+	header.programs_offset = sizeof(ProgramFileHeader);
+	header.programs_count = programs.size();
+	header.functions_offset = functions_offset;
+	header.functions_count = function_names.size();
+
+	memcpy(&buf[0], &header, sizeof(header));
+	if(!entries.empty())
+		memcpy(&buf[header.programs_offset], entries.data(), entries.size() * sizeof(ProgramFileEntry));
+	if(!function_refs.empty())
+		memcpy(&buf[functions_offset], function_refs.data(), function_refs.size() * sizeof(ProgramFileString));
+
+	std::string tmp_path = path + ".tmp"; // readers never see half-written file
+	std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+	file.write(buf.data(), buf.size());
+	file.close();
+	if(!file || rename(tmp_path.c_str(), path.c_str())){
+		ost << "Unable to write programs to " << path << std::endl;
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+ProgramFile::ProgramFile() : data(nullptr), size(0) {}
+
+ProgramFile::~ProgramFile(){
+	close();
+}
+
+bool inFile(uint64_t offset, uint64_t count, size_t item_size, size_t file_size, bool aligned){
+	return offset <= file_size && count <= (file_size - offset) / item_size && (!aligned || offset % 8 == 0);
+}
+
+bool ProgramFile::load(const std::string& path, std::ostream& ost){
+	close();
+
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(ProgramFileHeader)){
+		ost << "Unable to open programs file " << path << std::endl;
+		if(fd >= 0)
+			::close(fd);
+		return false;
+	}
+	size = st.st_size;
+	data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if(data == MAP_FAILED){
+		ost << "Unable to map programs file " << path << std::endl;
+		data = nullptr;
+		return false;
+	}
+
+	const char* base = static_cast<const char*>(data);
+	const ProgramFileHeader* header = static_cast<const ProgramFileHeader*>(data);
+	if(memcmp(header->magic, program_file_magic, sizeof(header->magic)) || header->version != PROGRAM_FILE_VERSION ||
+	   header->byte_order != 0x01020304 || header->file_size != size ||
+	   !inFile(header->programs_offset, header->programs_count, sizeof(ProgramFileEntry), size, true) ||
+	   !inFile(header->functions_offset, header->functions_count, sizeof(ProgramFileString), size, true)){
+		ost << "Programs file " << path << " is corrupted or has another version" << std::endl;
+		close();
+		return false;
+	}
+
+	const ProgramFileString* function_refs = reinterpret_cast<const ProgramFileString*>(base + header->functions_offset);
+	functions.reserve(header->functions_count);
+	for(uint64_t i = 0; i < header->functions_count; i++){
+		if(!inFile(function_refs[i].offset, function_refs[i].length, 1, size, false)){
+			ost << "Programs file " << path << " is corrupted or has another version" << std::endl;
+			close();
+			return false;
+		}
+		functions.emplace_back(std::string(base + function_refs[i].offset, function_refs[i].length)); // unknown function fails only programs that call it
+	}
+
+	const ProgramFileEntry* entries = reinterpret_cast<const ProgramFileEntry*>(base + header->programs_offset);
+	programs.reserve(header->programs_count);
+	texts.reserve(header->programs_count);
+	rows.reserve(header->programs_count);
+	for(uint64_t i = 0; i < header->programs_count; i++){ // only pointers are fixed, arrays are used right from the file
+		const ProgramFileEntry& entry = entries[i];
+		if(!inFile(entry.code_offset, entry.code_size, sizeof(Instruction), size, true) ||
+		   !inFile(entry.constants_offset, entry.constants_size, sizeof(double), size, true) ||
+		   !inFile(entry.text.offset, entry.text.length, 1, size, false) ||
+		   entry.depth == 0 || entry.depth > entry.code_size){ // every level of stack is pushed by its own instruction
+			ost << "Programs file " << path << " is corrupted or has another version" << std::endl;
+			close();
+			return false;
+		}
+
+		programs.push_back({ reinterpret_cast<const Instruction*>(base + entry.code_offset), entry.code_size,
+				     reinterpret_cast<const double*>(base + entry.constants_offset), entry.constants_size,
+				     functions.data(), functions.size(), entry.depth });
+		texts.push_back(entry.text);
+		rows.push_back(entry.row);
+	}
+	return true;
+}
+
+void ProgramFile::close(){
+	if(data)
+		munmap(data, size);
+	data = nullptr;
+	size = 0;
+	functions.clear();
+	programs.clear();
+	texts.clear();
+	rows.clear();
+}
+
+size_t ProgramFile::getCount() const { return programs.size(); }
+
+const ProgramView& ProgramFile::getProgram(size_t index) const { return programs.at(index); }
+
+uint64_t ProgramFile::getRow(size_t index) const { return rows.at(index); }
+
+std::string ProgramFile::getText(size_t index) const{
+	return std::string(static_cast<const char*>(data) + texts.at(index).offset, texts.at(index).length);
+}
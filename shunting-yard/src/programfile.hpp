@@ -0,0 +1,69 @@
+#pragma once
+#include "meta.hpp"
+#include "program.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/* Compiled programs saved in binary file that is used in place after mmap:
+	header | program entries | instructions | constants | function names | strings
+   Everything is referenced by offset from the beginning of the file, so file can be mapped at any address, and
+   every array is aligned for its type. Functions are saved by name and resolved in the function table
+   when file is loaded, so file doesn't depend on the libraries' addresses.
+ */
+#define PROGRAM_FILE_VERSION 2
+
+struct ProgramFileString{
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct ProgramFileHeader{
+	char magic[8]; // "SYPROG" followed by zeros
+	uint32_t version;
+	uint32_t byte_order; // 0x01020304 written in native order
+	uint64_t file_size;
+	uint64_t programs_offset; // ProgramFileEntry[programs_count]
+	uint64_t programs_count;
+	uint64_t functions_offset; // ProgramFileString[functions_count], FUNCTION instructions are indices in it
+	uint64_t functions_count;
+};
+
+struct ProgramFileEntry{
+	uint64_t code_offset; // Instruction[code_size]
+	uint64_t constants_offset; // double[constants_size]
+	uint32_t code_size;
+	uint32_t constants_size;
+	uint64_t depth;
+	uint64_t row; // input row the expression was read from, rows that failed to compile aren't saved
+	ProgramFileString text; // expression the program was compiled from
+};
+
+struct SourceProgram{
+	uint64_t row;
+	std::string text;
+	Program program;
+};
+
+// Problems are reported to ost
+bool writeProgramFile(const std::string& path, const std::vector<SourceProgram>& programs, std::ostream& ost);
+
+class ProgramFile{
+	void* data;
+	size_t size;
+	std::vector<Function> functions; // resolved once for all programs
+	std::vector<ProgramView> programs;
+	std::vector<ProgramFileString> texts;
+	std::vector<uint64_t> rows;
+public:
+	ProgramFile();
+	~ProgramFile();
+	bool load(const std::string& path, std::ostream& ost); // must be done while function table is read-locked
+	void close();
+	size_t getCount() const;
+	const ProgramView& getProgram(size_t index) const;
+	uint64_t getRow(size_t index) const;
+	std::string getText(size_t index) const;
+};
@@ -0,0 +1,271 @@
+#include "shmcache.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef SHM_CACHE_SUPPORT
+#define CACHE_MAGIC 0x5359434143484531ULL // "SYCACHE1"
+#define CACHE_VERSION 1
+
+/* Segment is a header followed by open-addressing table of entries. Every entry is protected by its own sequence
+   counter(seqlock): writer makes it odd while entry is changed, reader treats any change during the read
+   as a miss instead of retrying. So nobody ever waits. Entry left odd by process killed in the middle of write
+   is taken over by another writer after SHM_CACHE_STALE_USES uses of the cache; if its writer was only slow,
+   both of them may write the entry at once, and check rejects whatever mix of their fields readers see.
+ */
+struct CacheHeader{
+	std::atomic<uint64_t> magic; // written last, so segment isn't used until it is initialized
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t capacity; // number of entries, power of two
+	uint64_t check; // hash of fields above
+	std::atomic<uint64_t> clock; // incremented on every use, gives entries their age
+};
+
+struct CacheEntry{
+	std::atomic<uint64_t> seq;
+	std::atomic<uint64_t> first; // 0 if entry is empty
+	std::atomic<uint64_t> second;
+	std::atomic<uint64_t> value; // bits of double
+	std::atomic<uint64_t> check; // detects entries torn by writer that died
+	std::atomic<uint64_t> stamp; // last use or start of write, the oldest entry in probe window is evicted
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared cache needs lock-free 64-bit atomics");
+
+CacheHeader* cache_header = nullptr;
+CacheEntry* cache_entries = nullptr;
+size_t cache_size = 0;
+
+uint64_t mix(uint64_t x){ // splitmix64 finalizer
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t hashBytes(const char* data, size_t length, uint64_t seed){ // FNV-1a with mixed result
+	uint64_t hash = 0xcbf29ce484222325ULL ^ mix(seed);
+	for(size_t i = 0; i < length; i++){
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	return mix(hash);
+}
+
+CacheKey makeCacheKey(const std::string& text, uint64_t fingerprint){
+	CacheKey key;
+	key.first = hashBytes(text.data(), text.size(), fingerprint) | 1; // never 0, that marks empty entry
+	key.second = hashBytes(text.data(), text.size(), ~fingerprint);
+	return key;
+}
+
+uint64_t headerCheck(const CacheHeader* header){
+	return mix(header->version ^ mix(header->entry_size ^ mix(header->capacity)));
+}
+
+uint64_t entryCheck(uint64_t first, uint64_t second, uint64_t value){
+	return mix(first ^ mix(second ^ mix(value)));
+}
+
+bool validHeader(const CacheHeader* header, size_t size){
+	return header->magic.load(std::memory_order_acquire) == CACHE_MAGIC &&
+		header->version == CACHE_VERSION &&
+		header->entry_size == sizeof(CacheEntry) &&
+		header->check == headerCheck(header) &&
+		size == sizeof(CacheHeader) + header->capacity * sizeof(CacheEntry);
+}
+
+bool createSegment(const char* name, uint64_t entries){ // returns false if segment already exists or can't be created
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0)
+		return false;
+
+	size_t size = sizeof(CacheHeader) + entries * sizeof(CacheEntry);
+	void* mem = MAP_FAILED;
+	if(ftruncate(fd, size) == 0) // new memory is zeroed, so every entry is empty already
+		mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED){
+		shm_unlink(name);
+		errno = ENOMEM;
+		return false;
+	}
+
+	CacheHeader* header = static_cast<CacheHeader*>(mem);
+	header->version = CACHE_VERSION;
+	header->entry_size = sizeof(CacheEntry);
+	header->capacity = entries;
+	header->check = headerCheck(header);
+	header->magic.store(CACHE_MAGIC, std::memory_order_release);
+
+	cache_header = header;
+	cache_entries = reinterpret_cast<CacheEntry*>(header + 1);
+	cache_size = size;
+	return true;
+}
+
+bool openSegment(const char* name, ino_t& inode){ // returns false if segment can't be opened or stays invalid
+	inode = 0; // segment that was checked, it is recreated only if the name still refers to it
+	int fd = shm_open(name, O_RDWR, 0);
+	if(fd < 0)
+		return false;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_CACHE_ATTACH_MS);
+	void* mem = MAP_FAILED;
+	size_t size = 0;
+	do{ // creator may still be initializing the segment
+		struct stat st;
+		if(fstat(fd, &st) == 0)
+			inode = st.st_ino;
+		if(inode && static_cast<size_t>(st.st_size) > sizeof(CacheHeader)){
+			size = st.st_size;
+			mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if(mem != MAP_FAILED && validHeader(static_cast<CacheHeader*>(mem), size))
+				break;
+			if(mem != MAP_FAILED)
+				munmap(mem, size);
+			mem = MAP_FAILED;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	} while(std::chrono::steady_clock::now() < deadline);
+	close(fd);
+
+	if(mem == MAP_FAILED)
+		return false;
+
+	cache_header = static_cast<CacheHeader*>(mem);
+	cache_entries = reinterpret_cast<CacheEntry*>(cache_header + 1);
+	cache_size = size;
+	return true;
+}
+
+void unlinkSegment(const char* name, ino_t inode){ // another process may have recreated segment already
+	int fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+		return;
+	struct stat st;
+	bool same = fstat(fd, &st) == 0 && st.st_ino == inode;
+	close(fd);
+	if(same)
+		shm_unlink(name);
+}
+
+bool attachResultCache(const char* name, uint64_t entries, std::ostream& ost){
+	uint64_t capacity = 1;
+	while(capacity < entries)
+		capacity <<= 1;
+
+	for(int attempt = 0; attempt < 2; attempt++){
+		if(createSegment(name, capacity))
+			return true;
+		if(errno != EEXIST)
+			break;
+		ino_t inode;
+		if(openSegment(name, inode))
+			return true;
+		if(!inode) // it was removed meanwhile, so just create it again
+			continue;
+
+		ost << "Shared result cache " << name << " is corrupted or has another layout, recreating it" << std::endl;
+		unlinkSegment(name, inode);
+	}
+	ost << "Unable to attach shared result cache " << name << std::endl;
+	return false;
+}
+
+void detachResultCache(){
+	if(!cache_header)
+		return;
+
+	munmap(cache_header, cache_size);
+	cache_header = nullptr;
+	cache_entries = nullptr;
+	cache_size = 0;
+}
+
+bool lookupResult(const CacheKey& key, double& result){
+	if(!cache_header)
+		return false;
+
+	uint64_t mask = cache_header->capacity - 1;
+	for(uint64_t i = 0; i < SHM_CACHE_PROBES; i++){
+		CacheEntry& entry = cache_entries[(key.first + i) & mask];
+
+		uint64_t seq = entry.seq.load(std::memory_order_acquire);
+		if(seq & 1)
+			continue;
+		uint64_t first = entry.first.load(std::memory_order_relaxed);
+		uint64_t second = entry.second.load(std::memory_order_relaxed);
+		uint64_t value = entry.value.load(std::memory_order_relaxed);
+		uint64_t check = entry.check.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if(entry.seq.load(std::memory_order_relaxed) != seq)
+			continue;
+
+		if(first == key.first && second == key.second && check == entryCheck(first, second, value)){
+			entry.stamp.store(cache_header->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+			memcpy(&result, &value, sizeof(result));
+			return true;
+		}
+	}
+	return false;
+}
+
+void storeResult(const CacheKey& key, double result){
+	if(!cache_header)
+		return;
+
+	uint64_t mask = cache_header->capacity - 1;
+	uint64_t now = cache_header->clock.load(std::memory_order_relaxed);
+	CacheEntry* victim = nullptr;
+	uint64_t victim_seq = 0;
+	uint64_t oldest = UINT64_MAX;
+
+	for(uint64_t i = 0; i < SHM_CACHE_PROBES; i++){ // same key, empty or abandoned entry is taken first, otherwise the oldest one
+		CacheEntry& entry = cache_entries[(key.first + i) & mask];
+
+		uint64_t seq = entry.seq.load(std::memory_order_acquire);
+		if(seq & 1){
+			if(now - entry.stamp.load(std::memory_order_relaxed) < SHM_CACHE_STALE_USES)
+				continue; // it is being written right now
+			victim = &entry;
+			victim_seq = seq;
+			break;
+		}
+		uint64_t first = entry.first.load(std::memory_order_relaxed);
+		if(first == 0 || (first == key.first && entry.second.load(std::memory_order_relaxed) == key.second)){
+			victim = &entry;
+			victim_seq = seq;
+			break;
+		}
+		uint64_t stamp = entry.stamp.load(std::memory_order_relaxed);
+		if(stamp < oldest){
+			oldest = stamp;
+			victim = &entry;
+			victim_seq = seq;
+		}
+	}
+	uint64_t writing_seq = victim_seq + (victim_seq & 1 ? 2 : 1); // stays odd when abandoned entry is taken over
+	if(!victim || !victim->seq.compare_exchange_strong(victim_seq, writing_seq, std::memory_order_relaxed))
+		return; // another process writes there right now, result just isn't cached
+
+	victim->stamp.store(cache_header->clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	uint64_t value;
+	memcpy(&value, &result, sizeof(value));
+	victim->first.store(key.first, std::memory_order_relaxed);
+	victim->second.store(key.second, std::memory_order_relaxed);
+	victim->value.store(value, std::memory_order_relaxed);
+	victim->check.store(entryCheck(key.first, key.second, value), std::memory_order_relaxed);
+	victim->seq.store(writing_seq + 1, std::memory_order_release);
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+#include "meta.hpp"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <ostream>
+
+#ifdef SHM_CACHE_SUPPORT
+struct CacheKey{ // two independent hashes of expression text and fingerprint of libraries it depends on
+	uint64_t first;
+	uint64_t second;
+};
+
+uint64_t hashBytes(const char* data, size_t length, uint64_t seed);
+CacheKey makeCacheKey(const std::string& text, uint64_t fingerprint);
+
+/* Attaches to the result cache shared by all evaluator processes, creating it if needed. Segment that has wrong layout
+   or was left half-initialized by crashed process is recreated. Returns false if cache can't be used at all,
+   evaluation works without it then. Problems are reported to ost.
+ */
+bool attachResultCache(const char* name, uint64_t entries, std::ostream& ost);
+void detachResultCache();
+bool lookupResult(const CacheKey& key, double& result);
+void storeResult(const CacheKey& key, double result);
+#endif
@@ -0,0 +1,139 @@
+#pragma once
+#include "meta.hpp"
+#include "token.hpp"
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdlib>
+#include <cctype>
+
+/* Shunting-yard algorithm that reads expression character by character and gives operands and operators to Sink
+   in reverse polish order as soon as they are known, without creating tokens. Sink has to provide:
+	STATUS number(double num);
+	STATUS variable(const std::string& name, bool negated); // name without parentheses
+	STATUS function(const std::string& name, bool negated);
+	STATUS apply(const Operator& oper);
+	STATUS finish(); // called after the whole expression was given
+   Only operators waiting for closing brace or operator of lower priority are kept, so memory depends on nesting
+   of expression, not on its length.
+   Reads one line, returns false if there is no expression left. On error the rest of the line is skipped and
+   position is set to the column(starting from 1) of the token that caused it, for operator it is column of operator itself,
+   not of the token after which it was applied.
+ */
+template<class Sink>
+bool shuntingYard(std::streambuf* buf, Sink& sink, STATUS& status, size_t& position){
+	static thread_local std::vector<std::pair<Operator, size_t>> operators; // with their columns; kept between expressions to avoid allocations
+	static thread_local std::vector<size_t> braces; // size of operators stack at every unclosed left brace
+	static thread_local std::string lexeme;
+	bool after_brace = false; // minus right after left brace negates next number, variable or function
+	bool negate_next = false;
+	bool empty = true;
+	size_t column = 0;
+	int c;
+
+	operators.clear();
+	braces.clear();
+	status = STATUS::OK;
+	position = 0;
+
+	auto applyOperator = [&](){
+		status = sink.apply(operators.back().first);
+		if(status != STATUS::OK)
+			position = operators.back().second;
+		operators.pop_back();
+	};
+
+	while(status == STATUS::OK && (c = buf->sbumpc()) != EOF && c != '\n'){
+		column++;
+		if(isspace(c))
+			continue;
+		empty = false;
+		position = column;
+
+		if(negate_next && !isdigit(c) && !isalpha(c)){
+			status = STATUS::MINUS_BEFORE_UNALLOWED;
+			break;
+		}
+
+		lexeme.assign(1, c);
+		if(isalpha(c))
+			while(isalpha(buf->sgetc()))
+				lexeme += buf->sbumpc(), column++;
+
+		if(isdigit(c)){
+			while(isdigit(buf->sgetc()) || buf->sgetc() == '.')
+				lexeme += buf->sbumpc(), column++;
+
+			float num = strtof(lexeme.c_str(), nullptr);
+			status = sink.number(negate_next ? -num : num);
+			negate_next = false;
+		}
+		else if(c == '('){
+			braces.push_back(operators.size());
+			after_brace = true;
+			continue;
+		}
+		else if(c == ')'){
+			if(braces.empty()){
+				status = STATUS::PARENTHESIS_MISMATCH;
+				break;
+			}
+			while(status == STATUS::OK && operators.size() > braces.back())
+				applyOperator();
+			braces.pop_back();
+		}
+		else if(c == '-' && after_brace)
+			negate_next = true;
+		else if(Operator::isOperator(lexeme)){
+			if(negate_next){
+				status = STATUS::MINUS_BEFORE_UNALLOWED;
+				break;
+			}
+			Operator oper(lexeme);
+			size_t bottom = braces.empty() ? 0 : braces.back();
+			while(status == STATUS::OK && operators.size() > bottom &&
+			      (operators.back().first > oper || (operators.back().first == oper && !oper.getAssoc())))
+				applyOperator();
+			operators.push_back({ oper, column - lexeme.size() + 1 });
+		}
+		else if(isalpha(c)){
+			if(buf->sgetc() != '(') // only peek, newline of the next row mustn't be consumed
+				status = sink.variable(lexeme, negate_next);
+			else{
+				buf->sbumpc();
+				column++;
+				if(buf->sgetc() != ')'){
+					status = STATUS::NO_PARENTHESES;
+					break;
+				}
+				buf->sbumpc();
+				column++;
+				status = sink.function(lexeme, negate_next);
+			}
+			negate_next = false;
+		}
+		else
+			status = STATUS::UNKNOWN_SYMBOL;
+		after_brace = false;
+	}
+
+	if(status != STATUS::OK){
+		while(c != EOF && c != '\n')
+			c = buf->sbumpc();
+		return true;
+	}
+	if(c == EOF && column == 0)
+		return false;
+
+	position = column + 1; // errors found at the end of expression
+	if(empty)
+		status = STATUS::EMPTY_EXPRESSION;
+	else if(!braces.empty() || negate_next)
+		status = STATUS::PARENTHESIS_MISMATCH;
+	while(status == STATUS::OK && !operators.empty())
+		applyOperator();
+	if(status == STATUS::OK)
+		status = sink.finish();
+	return true;
+}
@@ -1,8 +1,7 @@
 #include "token.hpp"
-
-#ifdef LIB_SUPPORT
-extern std::unordered_map<std::string, void*> func_map;
-#endif
+#include "importlib.hpp"
+#include <chrono>
+#include <cmath>
 
 std::unordered_map<std::string, OPER_TUPLE> prior_table; // gets operator as key, returns information on operator
 
@@ -45,6 +44,10 @@ bool Operator::isOperator(const std::string::iterator& it){
 	}
 }
 
+bool Operator::isOperator(const std::string& key){
+	return prior_table.count(key);
+}
+
 void Operator::initOperatorsTable(){
 	prior_table["+"]=OPER_TUPLE(OPERATORS::ADD, 1, false);
 	prior_table["-"]=OPER_TUPLE(OPERATORS::SUBSTRACT, 1, false);
@@ -95,7 +98,14 @@ Operator::Operator(std::string::iterator& it)
 	}
 	else key=std::string(1, *it++); /* increment could lead to error in expression parsing if operator can't be matched at all
 					   Operator::isOperator() handles the case if the symbol being processed is not operator */
+	setOperator(key);
+}
+
+Operator::Operator(const std::string& key){
+	setOperator(key);
+}
 
+void Operator::setOperator(const std::string& key){
 	const OPER_TUPLE& tuple=prior_table[key];
 	oper=std::get<0>(tuple);
 	priority=std::get<1>(tuple);
@@ -119,6 +129,32 @@ double Number::operator/(const Number& oper) const{
 	return this->getNum() / oper.getNum();
 }
 
+STATUS calculate(double first_operand, double second_operand, enum OPERATORS oper, double& result){
+	double garbage_ptr;
+
+	switch(oper){
+	case OPERATORS::ADD:
+		result = first_operand + second_operand;
+		break;
+	case OPERATORS::SUBSTRACT:
+		result = first_operand - second_operand;
+		break;
+	case OPERATORS::MULTIPLY:
+		result = first_operand * second_operand;
+		break;
+	case OPERATORS::DIVIDE:
+		result = first_operand / second_operand;
+		break;
+	case OPERATORS::XOR:
+		if( modf(first_operand, &garbage_ptr) != 0.0 ||
+		    modf(second_operand, &garbage_ptr ) != 0.0 )
+			return STATUS::NON_INTEGRAL_XOR;
+		result = static_cast<int>(first_operand) ^ static_cast<int>(second_operand);
+		break;
+	}
+	return STATUS::OK;
+}
+
 const TAG Number::getTag() const { return TAG::NUMBER; }
 
 double Number::getNum() const { return num; }
@@ -136,26 +172,36 @@ Brace::Brace(const std::string::iterator& it){
 		brace=TAG::RIGHT_BRACE;
 }
 
-#ifdef LIB_SUPPORT
 Function::Function(const std::string& name){
-	try{
-		func_map.at(name);
-	} catch(const std::out_of_range& exc){
-		std::cout << "No function loaded with name " << name << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	
+#ifdef LIB_SUPPORT
+	memAddress = findFunction(name); // address stays valid while function table is read-locked
+#else
+	memAddress = nullptr; // there is nowhere to import it from, so it is never loaded
+#endif
 	this->name = name;
 	numberOfOperators = 0;
-	memAddress = func_map[name];
+#ifdef SHM_CACHE_SUPPORT
+	pure = isPureFunction(name);
+#endif
+#ifdef FUNC_STATS_SUPPORT
+	stats = findFunctionStats(name);
+#endif
 }
 
 const TAG Function::getTag() const { return TAG::FUNCTION; }
 
+bool Function::isLoaded() const { return memAddress != nullptr; }
+
 double Function::call() const {
 	using func_t = double (*)();
 	func_t func_pnt = (func_t) memAddress;
+#ifdef FUNC_STATS_SUPPORT
+	auto start = std::chrono::steady_clock::now();
 	double result = func_pnt();
+	stats->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+#else
+	double result = func_pnt();
+#endif
 # ifdef NEG_SUPPORT
 	if(getNegated())
 		result = -result;
@@ -164,6 +210,9 @@ double Function::call() const {
 }
 
 std::string Function::getName() const { return name; }
+
+#ifdef SHM_CACHE_SUPPORT
+bool Function::isPure() const { return pure; }
 #endif
 
 #ifdef NEG_SUPPORT
@@ -208,6 +257,34 @@ std::ostream& operator<<(std::ostream& ost, enum OPERATORS oper){
 	return ost << tag_print;
 }
 
+const char* statusMessage(STATUS status){
+	switch(status){
+	case STATUS::OK:
+		return "";
+	case STATUS::EMPTY_EXPRESSION:
+		return "empty expression";
+	case STATUS::MALFORMED_EXPRESSION:
+		return "malformed expression";
+	case STATUS::UNKNOWN_SYMBOL:
+		return "unknown symbol";
+	case STATUS::UNKNOWN_FUNCTION:
+		return "no function loaded with this name";
+	case STATUS::NO_PARENTHESES:
+		return "no parentheses detected for function";
+	case STATUS::PARENTHESIS_MISMATCH:
+		return "parenthesis mismatch";
+	case STATUS::MINUS_BEFORE_UNALLOWED:
+		return "minus sign before unallowed token";
+	case STATUS::NON_INTEGRAL_XOR:
+		return "xor can't be applied to non-integral values";
+	case STATUS::UNKNOWN_VARIABLE:
+		return "no column with this name";
+	case STATUS::UNKNOWN_AGGREGATE:
+		return "unknown aggregate, use sum, min, max or mean";
+	}
+	return "unknown error";
+}
+
 #ifndef NDEBUG
 std::ostream& operator<<(std::ostream& ost, const Token& tok){
 	std::string tag_print;
@@ -1,4 +1,6 @@
+#pragma once
 #include "meta.hpp"
+#include "funcstats.hpp"
 #include <tuple>
 #include <list>
 #include <string>
@@ -26,6 +28,20 @@ enum class OPERATORS{
 	XOR
 };
 
+enum class STATUS{ // errors are returned instead of exiting, so one bad expression doesn't stop the others
+	OK,
+	EMPTY_EXPRESSION,
+	MALFORMED_EXPRESSION,
+	UNKNOWN_SYMBOL,
+	UNKNOWN_FUNCTION,
+	NO_PARENTHESES,
+	PARENTHESIS_MISMATCH,
+	MINUS_BEFORE_UNALLOWED,
+	NON_INTEGRAL_XOR,
+	UNKNOWN_VARIABLE,
+	UNKNOWN_AGGREGATE
+};
+
 using OPER_TUPLE=std::tuple<OPERATORS, int, bool>;
 
 class Token{
@@ -52,8 +68,10 @@ class Operator : public Token{
 	int priority;
 	bool isRightAssociative;
 	enum OPERATORS oper;
+	void setOperator(const std::string& key);
 public:
 	static bool isOperator(const std::string::iterator& it);
+	static bool isOperator(const std::string& key); // key is the whole operator, i.e. "+" or "xor"
 	static void initOperatorsTable();
 	bool operator<(const Operator& op) const;
 	bool operator>(const Operator& op) const;
@@ -62,6 +80,7 @@ public:
 	const bool getAssoc() const;
 	const enum OPERATORS getOperatorTag() const;
 	Operator(std::string::iterator& it);
+	Operator(const std::string& key);
 };
 
 class Number : public Token
@@ -98,14 +117,27 @@ class Function : public Token
 	std::string name;
 	int numberOfOperators;
 	void* memAddress;
+#ifdef SHM_CACHE_SUPPORT
+	bool pure;
+#endif
+#ifdef FUNC_STATS_SUPPORT
+	FunctionStats* stats;
+#endif
 public:
 	Function(const std::string& name);
 	const TAG getTag() const override;
+	bool isLoaded() const; // false if there is no function with such name, it mustn't be called then
 	std::string getName() const;
 	double call() const;
+#ifdef SHM_CACHE_SUPPORT
+	bool isPure() const;
+#endif
 };
 
+STATUS calculate(double first_operand, double second_operand, enum OPERATORS oper, double& result);
+
 std::ostream& operator<<(std::ostream& ost, enum OPERATORS oper);
+const char* statusMessage(STATUS status);
 
 #ifndef NDEBUG
 std::ostream& operator<<(std::ostream& ost, const Token& tok);